@@ -3,11 +3,18 @@
 
 #include "common.h"
 #include "mapper.h"
+#include "scheduler.h"
 
 #define SAMPLES 1024
 #define SAMPLE_RATE 44100
+#define CHANNELS 2
 #define APU_RATE 1789773
 
+/** band-limited steps are spread over BLIP_WIDTH output samples */
+#define BLIP_WIDTH 16
+#define BLIP_PHASES 32
+#define BLIP_SIZE 4096
+
 typedef struct {
   bool enabled;
   bool loop;
@@ -97,6 +104,15 @@ typedef struct {
   bool stall;
 } DMC;
 
+/**
+ * Receives the mixed output as interleaved stereo frames at SAMPLE_RATE, at
+ * least once per emulated frame. A NULL write function discards the samples.
+ */
+typedef struct {
+  void (*write)(void *userdata, const float *samples, uint32_t count);
+  void *userdata;
+} AudioSink;
+
 typedef struct {
   Pulse pulses[2];
   Triangle triangle;
@@ -109,16 +125,35 @@ typedef struct {
   float buffer[SAMPLES];
   uint32_t buffer_index;
 
-  uint32_t cycles;
+  /** mixed level, every change is added to blip as a band-limited step */
+  float output;
+  float blip[BLIP_SIZE + BLIP_WIDTH];
+  double blip_level;
+  /** output sample position of blip_cycle, 32.32 fixed point */
+  uint64_t blip_position;
+  uint64_t blip_cycle;
+  /** output samples per cpu cycle, 32.32 fixed point */
+  uint64_t blip_factor;
+
+  /** cpu cycles run so far, lags behind the master clock */
+  uint64_t cycles;
+  /** cycle of the next frame sequencer step */
+  uint64_t frame_deadline;
   uint32_t frame_step;
+  /** last write to $4017, bit 7 selects 5-step mode and bit 6 inhibits the irq */
   uint8_t frame_counter;
   bool frame_irq_active;
 
+  AudioSink sink;
+
   Mapper *mapper;
+  Scheduler *scheduler;
 } APU;
 
-void apu_init(APU *apu, Mapper *mapper);
-void apu_step(APU *apu);
+void apu_init(APU *apu, Mapper *mapper, Scheduler *scheduler);
+void apu_run(APU *apu, uint64_t cycle);
+void apu_end_frame(APU *apu);
+void apu_set_sample_rate(APU *apu, double rate);
 uint8_t apu_read(APU *apu, uint16_t address);
 void apu_write(APU *apu, uint16_t address, uint8_t value);
 
@@ -0,0 +1,60 @@
+#ifndef __AUDIO_H__
+#define __AUDIO_H__
+
+#include "common.h"
+
+#include <stdio.h>
+
+/** about 90ms of stereo samples, must be a power of two */
+#define AUDIO_RING_SIZE 8192
+
+/**
+ * Single producer, single consumer queue of samples. The emulation writes
+ * and the audio thread reads, neither of them ever waits for the other.
+ */
+typedef struct {
+  float samples[AUDIO_RING_SIZE];
+
+  /** free running positions, only the producer moves head */
+  uint32_t head;
+  uint32_t tail;
+
+  /** samples dropped because the ring was full */
+  uint32_t overruns;
+  /** samples the consumer asked for but were not there yet */
+  uint32_t underruns;
+} AudioRing;
+
+typedef enum {
+  AUDIO_FILE_RAW, // native float32 samples, nothing else
+  AUDIO_FILE_WAV, // 32-bit float wav
+} AudioFileFormat;
+
+/**
+ * Writes samples to disk through a large stdio buffer. Its write function
+ * fits an AudioSink, so offline renders need no audio device.
+ */
+typedef struct {
+  FILE *file;
+  AudioFileFormat format;
+  uint16_t channels;
+  uint32_t rate;
+  /** samples written so far, the wav sizes are patched in on close */
+  uint64_t samples;
+  /** samples the file can hold, wav sizes are 32 bit */
+  uint64_t limit;
+  /** samples were dropped because the limit was reached */
+  bool truncated;
+} AudioFile;
+
+void audio_ring_init(AudioRing *ring);
+uint32_t audio_ring_write(AudioRing *ring, const float *samples, uint32_t count);
+uint32_t audio_ring_read(AudioRing *ring, float *samples, uint32_t count);
+uint32_t audio_ring_count(AudioRing *ring);
+
+bool audio_file_open(AudioFile *file, const char *path, AudioFileFormat format,
+                     uint16_t channels, uint32_t rate);
+void audio_file_write(void *userdata, const float *samples, uint32_t count);
+bool audio_file_close(AudioFile *file);
+
+#endif // __AUDIO_H__
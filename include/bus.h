@@ -5,33 +5,56 @@
 #include "mapper.h"
 #include "apu.h"
 #include "ppu.h"
+#include "scheduler.h"
+
+#define BUS_PAGES 256
 
 typedef struct {
   // 2KB of CPU RAM
   uint8_t ram[2048];
 
+  /**
+   * host memory backing each 256 byte page of the cpu address space. NULL
+   * pages (i/o registers, mapper registers, open bus) go through the slow
+   * path. refreshed whenever the mapper switches prg banks
+   */
+  uint8_t *read_pages[BUS_PAGES];
+  uint8_t *write_pages[BUS_PAGES];
+  /** the mapper's prg_version the pages were built from */
+  uint32_t prg_version;
+
+  /** bumped whenever the page table is rebuilt or the prg rom written to */
+  uint32_t map_version;
+  uint32_t rom_version;
+
   // input
   uint8_t *controller;
   uint8_t controller_state[2];
 
   // dma
   uint8_t dma_page;
-  uint8_t dma_addr;
-  uint8_t dma_data;
-  /** is a dma transfer in progress? */ 
+  /** was a transfer requested by the last instruction? */
+  uint8_t dma_request;
+  /** is a dma transfer in progress? the cpu is halted until it completes */
   uint8_t dma_transfer;
-  /** dummy read */
-  uint8_t dma_dummy;
+
+  /** the ppu and apu are caught up to the master clock on access */
+  Scheduler *scheduler;
 
   Mapper *mapper;
   PPU *ppu;
   APU *apu;
 } Bus;
 
-void bus_init(Bus *bus, Mapper *mapper, PPU *ppu, APU *apu, uint8_t *controller);
+void bus_init(Bus *bus, Mapper *mapper, PPU *ppu, APU *apu, Scheduler *scheduler,
+              uint8_t *controller);
 void bus_write(Bus *bus, uint16_t addr, uint8_t data);
 uint8_t bus_read(Bus *bus, uint16_t addr, bool readonly);
 uint16_t bus_read_wide(Bus *bus, uint16_t addr, bool readonly);
-void bus_dma_transfer(Bus *bus, int cycles);
+void bus_dma_transfer(Bus *bus);
+void bus_map_pages(Bus *bus);
+void bus_sync_ppu(Bus *bus);
+void bus_sync_apu(Bus *bus);
+bool bus_irq_line(Bus *bus);
 
 #endif // __BUS_H__
@@ -15,6 +15,24 @@ typedef enum {
   FLAG_NEGATIVE = 0x80
 } StatusFlag;
 
+typedef struct {
+  uint16_t operand;
+  uint8_t opcode;
+  /** bytes taken by the instruction, 0 when not decoded yet */
+  uint8_t size;
+} DecodedInstruction;
+
+/**
+ * registers the last time a loop jumped back to pc
+ */
+typedef struct {
+  uint16_t pc;
+  uint8_t a, x, y, sp, status;
+  uint64_t clock;
+  /** the loop at pc was already found not to be idle */
+  bool rejected;
+} IdleState;
+
 typedef struct {
   uint8_t a;      // accumulator
   uint8_t x;      // x register
@@ -25,11 +43,32 @@ typedef struct {
 
   int cycles;
 
+  /**
+   * decoded instructions by offset into prg rom, so banks keep them while
+   * switched out, along with where each 256 byte page of $8000-$FFFF starts
+   * in them (NULL when it is not rom)
+   */
+  DecodedInstruction decoded[PRG_MEMORY_SIZE];
+  DecodedInstruction *decoded_pages[128];
+  uint32_t map_version;
+  uint32_t rom_version;
+
+  /** zero page and stack page, always plain ram */
+  uint8_t *zero_page;
+  uint8_t *stack_page;
+
+  IdleState idle;
+
+  /** compiler for hot rom code, NULL when running interpreted */
+  struct Jit *jit;
+
   Bus *bus;
 } CPU;
 
 void cpu_init(CPU *cpu, Bus *bus);
 uint8_t cpu_step(CPU *cpu);
+void cpu_run(CPU *cpu);
+void cpu_idle(CPU *cpu);
 
 void cpu_reset(CPU *cpu);
 void cpu_irq(CPU *cpu);
@@ -6,12 +6,14 @@
 #include "ppu.h"
 #include "apu.h"
 #include "mapper.h"
+#include "scheduler.h"
 
 #define NES_MAGIC_NUMBER "NES\x1a"
 #define NES_PRG_ROM_CHUNK_SIZE 0x4000
 #define NES_CHR_ROM_CHUNK_SIZE 0x2000
 
 typedef struct {
+  Scheduler scheduler;
   Bus bus;
   CPU cpu;
   PPU ppu;
@@ -25,8 +27,6 @@ typedef struct {
 
   /** Input */
   uint8_t controller[2];
-
-  int cycles;
 } Emulator;
 
 void emulator_init(Emulator *emulator, char *filename);
@@ -2,14 +2,27 @@
 #define __FRONTEND_H__
 
 #include <stdint.h>
+#include "audio.h"
 #include "emulator.h"
 
 typedef struct {
+  void *window;
   void *renderer;
   void *texture;
 
   // debug
+  bool debug;
   void *pattern_table_textures[2];
+  void *nametable_texture;
+
+  // frame skip
+  double frame_due;
+  int frames_skipped;
+
+  // audio, drained by the sdl audio thread
+  uint32_t audio_device;
+  AudioRing audio;
+  float audio_last[CHANNELS];
 } Frontend;
 
 void frontend_init(Frontend *frontend);
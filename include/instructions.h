@@ -25,135 +25,272 @@ typedef struct {
   uint8_t cycles;
 } Instruction;
 
-Instruction instructions[] = {
-    {"BRK", ADDR_MODE_IMM, 7}, {"ORA", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 3}, {"ORA", ADDR_MODE_ZP0, 3},
-    {"ASL", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"PHP", ADDR_MODE_IMP, 3}, {"ORA", ADDR_MODE_IMM, 2},
-    {"ASL", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"???", ADDR_MODE_IMP, 4}, {"ORA", ADDR_MODE_ABS, 4},
-    {"ASL", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BPL", ADDR_MODE_REL, 2}, {"ORA", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"ORA", ADDR_MODE_ZPX, 4},
-    {"ASL", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"CLC", ADDR_MODE_IMP, 2}, {"ORA", ADDR_MODE_ABY, 4},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"ORA", ADDR_MODE_ABX, 4},
-    {"ASL", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-    {"JSR", ADDR_MODE_ABS, 6}, {"AND", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"BIT", ADDR_MODE_ZP0, 3}, {"AND", ADDR_MODE_ZP0, 3},
-    {"ROL", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"PLP", ADDR_MODE_IMP, 4}, {"AND", ADDR_MODE_IMM, 2},
-    {"ROL", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"BIT", ADDR_MODE_ABS, 4}, {"AND", ADDR_MODE_ABS, 4},
-    {"ROL", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BMI", ADDR_MODE_REL, 2}, {"AND", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"AND", ADDR_MODE_ZPX, 4},
-    {"ROL", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"SEC", ADDR_MODE_IMP, 2}, {"AND", ADDR_MODE_ABY, 4},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"AND", ADDR_MODE_ABX, 4},
-    {"ROL", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-    {"RTI", ADDR_MODE_IMP, 6}, {"EOR", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 3}, {"EOR", ADDR_MODE_ZP0, 3},
-    {"LSR", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"PHA", ADDR_MODE_IMP, 3}, {"EOR", ADDR_MODE_IMM, 2},
-    {"LSR", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"JMP", ADDR_MODE_ABS, 3}, {"EOR", ADDR_MODE_ABS, 4},
-    {"LSR", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BVC", ADDR_MODE_REL, 2}, {"EOR", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"EOR", ADDR_MODE_ZPX, 4},
-    {"LSR", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"CLI", ADDR_MODE_IMP, 2}, {"EOR", ADDR_MODE_ABY, 4},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"EOR", ADDR_MODE_ABX, 4},
-    {"LSR", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-    {"RTS", ADDR_MODE_IMP, 6}, {"ADC", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 3}, {"ADC", ADDR_MODE_ZP0, 3},
-    {"ROR", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"PLA", ADDR_MODE_IMP, 4}, {"ADC", ADDR_MODE_IMM, 2},
-    {"ROR", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"JMP", ADDR_MODE_IND, 5}, {"ADC", ADDR_MODE_ABS, 4},
-    {"ROR", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BVS", ADDR_MODE_REL, 2}, {"ADC", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"ADC", ADDR_MODE_ZPX, 4},
-    {"ROR", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"SEI", ADDR_MODE_IMP, 2}, {"ADC", ADDR_MODE_ABY, 4},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"ADC", ADDR_MODE_ABX, 4},
-    {"ROR", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 2}, {"STA", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 6},
-    {"STY", ADDR_MODE_ZP0, 3}, {"STA", ADDR_MODE_ZP0, 3},
-    {"STX", ADDR_MODE_ZP0, 3}, {"???", ADDR_MODE_IMP, 3},
-    {"DEY", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"TXA", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"STY", ADDR_MODE_ABS, 4}, {"STA", ADDR_MODE_ABS, 4},
-    {"STX", ADDR_MODE_ABS, 4}, {"???", ADDR_MODE_IMP, 4},
-    {"BCC", ADDR_MODE_REL, 2}, {"STA", ADDR_MODE_IZY, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 6},
-    {"STY", ADDR_MODE_ZPX, 4}, {"STA", ADDR_MODE_ZPX, 4},
-    {"STX", ADDR_MODE_ZPY, 4}, {"???", ADDR_MODE_IMP, 4},
-    {"TYA", ADDR_MODE_IMP, 2}, {"STA", ADDR_MODE_ABY, 5},
-    {"TXS", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 5},
-    {"???", ADDR_MODE_IMP, 5}, {"STA", ADDR_MODE_ABX, 5},
-    {"???", ADDR_MODE_IMP, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"LDY", ADDR_MODE_IMM, 2}, {"LDA", ADDR_MODE_IZX, 6},
-    {"LDX", ADDR_MODE_IMM, 2}, {"???", ADDR_MODE_IMP, 6},
-    {"LDY", ADDR_MODE_ZP0, 3}, {"LDA", ADDR_MODE_ZP0, 3},
-    {"LDX", ADDR_MODE_ZP0, 3}, {"???", ADDR_MODE_IMP, 3},
-    {"TAY", ADDR_MODE_IMP, 2}, {"LDA", ADDR_MODE_IMM, 2},
-    {"TAX", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"LDY", ADDR_MODE_ABS, 4}, {"LDA", ADDR_MODE_ABS, 4},
-    {"LDX", ADDR_MODE_ABS, 4}, {"???", ADDR_MODE_IMP, 4},
-    {"BCS", ADDR_MODE_REL, 2}, {"LDA", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 5},
-    {"LDY", ADDR_MODE_ZPX, 4}, {"LDA", ADDR_MODE_ZPX, 4},
-    {"LDX", ADDR_MODE_ZPY, 4}, {"???", ADDR_MODE_IMP, 4},
-    {"CLV", ADDR_MODE_IMP, 2}, {"LDA", ADDR_MODE_ABY, 4},
-    {"TSX", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 4},
-    {"LDY", ADDR_MODE_ABX, 4}, {"LDA", ADDR_MODE_ABX, 4},
-    {"LDX", ADDR_MODE_ABY, 4}, {"???", ADDR_MODE_IMP, 4},
-    {"CPY", ADDR_MODE_IMM, 2}, {"CMP", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"CPY", ADDR_MODE_ZP0, 3}, {"CMP", ADDR_MODE_ZP0, 3},
-    {"DEC", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"INY", ADDR_MODE_IMP, 2}, {"CMP", ADDR_MODE_IMM, 2},
-    {"DEX", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"CPY", ADDR_MODE_ABS, 4}, {"CMP", ADDR_MODE_ABS, 4},
-    {"DEC", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BNE", ADDR_MODE_REL, 2}, {"CMP", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"CMP", ADDR_MODE_ZPX, 4},
-    {"DEC", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"CLD", ADDR_MODE_IMP, 2}, {"CMP", ADDR_MODE_ABY, 4},
-    {"NOP", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"CMP", ADDR_MODE_ABX, 4},
-    {"DEC", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-    {"CPX", ADDR_MODE_IMM, 2}, {"SBC", ADDR_MODE_IZX, 6},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"CPX", ADDR_MODE_ZP0, 3}, {"SBC", ADDR_MODE_ZP0, 3},
-    {"INC", ADDR_MODE_ZP0, 5}, {"???", ADDR_MODE_IMP, 5},
-    {"INX", ADDR_MODE_IMP, 2}, {"SBC", ADDR_MODE_IMM, 2},
-    {"NOP", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 2},
-    {"CPX", ADDR_MODE_ABS, 4}, {"SBC", ADDR_MODE_ABS, 4},
-    {"INC", ADDR_MODE_ABS, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"BEQ", ADDR_MODE_REL, 2}, {"SBC", ADDR_MODE_IZY, 5},
-    {"???", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 8},
-    {"???", ADDR_MODE_IMP, 4}, {"SBC", ADDR_MODE_ZPX, 4},
-    {"INC", ADDR_MODE_ZPX, 6}, {"???", ADDR_MODE_IMP, 6},
-    {"SED", ADDR_MODE_IMP, 2}, {"SBC", ADDR_MODE_ABY, 4},
-    {"NOP", ADDR_MODE_IMP, 2}, {"???", ADDR_MODE_IMP, 7},
-    {"???", ADDR_MODE_IMP, 4}, {"SBC", ADDR_MODE_ABX, 4},
-    {"INC", ADDR_MODE_ABX, 7}, {"???", ADDR_MODE_IMP, 7},
-};
+/**
+ * X(opcode, mnemonic, operation, addressing mode, cycles)
+ *
+ * the cpu generates one fused handler per entry, unofficial opcodes are
+ * listed as ILL (except for a few that happen to decode as stores)
+ */
+#define INSTRUCTIONS(X) \
+  X(0x00, "BRK", BRK, IMM, 7) \
+  X(0x01, "ORA", ORA, IZX, 6) \
+  X(0x02, "???", ILL, IMP, 2) \
+  X(0x03, "???", ILL, IMP, 8) \
+  X(0x04, "???", ILL, IMP, 3) \
+  X(0x05, "ORA", ORA, ZP0, 3) \
+  X(0x06, "ASL", ASL, ZP0, 5) \
+  X(0x07, "???", ILL, IMP, 5) \
+  X(0x08, "PHP", PHP, IMP, 3) \
+  X(0x09, "ORA", ORA, IMM, 2) \
+  X(0x0A, "ASL", ASL, IMP, 2) \
+  X(0x0B, "???", ILL, IMP, 2) \
+  X(0x0C, "???", ILL, IMP, 4) \
+  X(0x0D, "ORA", ORA, ABS, 4) \
+  X(0x0E, "ASL", ASL, ABS, 6) \
+  X(0x0F, "???", ILL, IMP, 6) \
+  X(0x10, "BPL", BPL, REL, 2) \
+  X(0x11, "ORA", ORA, IZY, 5) \
+  X(0x12, "???", ILL, IMP, 2) \
+  X(0x13, "???", ILL, IMP, 8) \
+  X(0x14, "???", ILL, IMP, 4) \
+  X(0x15, "ORA", ORA, ZPX, 4) \
+  X(0x16, "ASL", ASL, ZPX, 6) \
+  X(0x17, "???", ILL, IMP, 6) \
+  X(0x18, "CLC", CLC, IMP, 2) \
+  X(0x19, "ORA", ORA, ABY, 4) \
+  X(0x1A, "???", ILL, IMP, 2) \
+  X(0x1B, "???", ILL, IMP, 7) \
+  X(0x1C, "???", ILL, IMP, 4) \
+  X(0x1D, "ORA", ORA, ABX, 4) \
+  X(0x1E, "ASL", ASL, ABX, 7) \
+  X(0x1F, "???", ILL, IMP, 7) \
+  X(0x20, "JSR", JSR, ABS, 6) \
+  X(0x21, "AND", AND, IZX, 6) \
+  X(0x22, "???", ILL, IMP, 2) \
+  X(0x23, "???", ILL, IMP, 8) \
+  X(0x24, "BIT", BIT, ZP0, 3) \
+  X(0x25, "AND", AND, ZP0, 3) \
+  X(0x26, "ROL", ROL, ZP0, 5) \
+  X(0x27, "???", ILL, IMP, 5) \
+  X(0x28, "PLP", PLP, IMP, 4) \
+  X(0x29, "AND", AND, IMM, 2) \
+  X(0x2A, "ROL", ROL, IMP, 2) \
+  X(0x2B, "???", ILL, IMP, 2) \
+  X(0x2C, "BIT", BIT, ABS, 4) \
+  X(0x2D, "AND", AND, ABS, 4) \
+  X(0x2E, "ROL", ROL, ABS, 6) \
+  X(0x2F, "???", ILL, IMP, 6) \
+  X(0x30, "BMI", BMI, REL, 2) \
+  X(0x31, "AND", AND, IZY, 5) \
+  X(0x32, "???", ILL, IMP, 2) \
+  X(0x33, "???", ILL, IMP, 8) \
+  X(0x34, "???", ILL, IMP, 4) \
+  X(0x35, "AND", AND, ZPX, 4) \
+  X(0x36, "ROL", ROL, ZPX, 6) \
+  X(0x37, "???", ILL, IMP, 6) \
+  X(0x38, "SEC", SEC, IMP, 2) \
+  X(0x39, "AND", AND, ABY, 4) \
+  X(0x3A, "???", ILL, IMP, 2) \
+  X(0x3B, "???", ILL, IMP, 7) \
+  X(0x3C, "???", ILL, IMP, 4) \
+  X(0x3D, "AND", AND, ABX, 4) \
+  X(0x3E, "ROL", ROL, ABX, 7) \
+  X(0x3F, "???", ILL, IMP, 7) \
+  X(0x40, "RTI", RTI, IMP, 6) \
+  X(0x41, "EOR", EOR, IZX, 6) \
+  X(0x42, "???", ILL, IMP, 2) \
+  X(0x43, "???", ILL, IMP, 8) \
+  X(0x44, "???", ILL, IMP, 3) \
+  X(0x45, "EOR", EOR, ZP0, 3) \
+  X(0x46, "LSR", LSR, ZP0, 5) \
+  X(0x47, "???", ILL, IMP, 5) \
+  X(0x48, "PHA", PHA, IMP, 3) \
+  X(0x49, "EOR", EOR, IMM, 2) \
+  X(0x4A, "LSR", LSR, IMP, 2) \
+  X(0x4B, "???", ILL, IMP, 2) \
+  X(0x4C, "JMP", JMP, ABS, 3) \
+  X(0x4D, "EOR", EOR, ABS, 4) \
+  X(0x4E, "LSR", LSR, ABS, 6) \
+  X(0x4F, "???", ILL, IMP, 6) \
+  X(0x50, "BVC", BVC, REL, 2) \
+  X(0x51, "EOR", EOR, IZY, 5) \
+  X(0x52, "???", ILL, IMP, 2) \
+  X(0x53, "???", ILL, IMP, 8) \
+  X(0x54, "???", ILL, IMP, 4) \
+  X(0x55, "EOR", EOR, ZPX, 4) \
+  X(0x56, "LSR", LSR, ZPX, 6) \
+  X(0x57, "???", ILL, IMP, 6) \
+  X(0x58, "CLI", CLI, IMP, 2) \
+  X(0x59, "EOR", EOR, ABY, 4) \
+  X(0x5A, "???", ILL, IMP, 2) \
+  X(0x5B, "???", ILL, IMP, 7) \
+  X(0x5C, "???", ILL, IMP, 4) \
+  X(0x5D, "EOR", EOR, ABX, 4) \
+  X(0x5E, "LSR", LSR, ABX, 7) \
+  X(0x5F, "???", ILL, IMP, 7) \
+  X(0x60, "RTS", RTS, IMP, 6) \
+  X(0x61, "ADC", ADC, IZX, 6) \
+  X(0x62, "???", ILL, IMP, 2) \
+  X(0x63, "???", ILL, IMP, 8) \
+  X(0x64, "???", ILL, IMP, 3) \
+  X(0x65, "ADC", ADC, ZP0, 3) \
+  X(0x66, "ROR", ROR, ZP0, 5) \
+  X(0x67, "???", ILL, IMP, 5) \
+  X(0x68, "PLA", PLA, IMP, 4) \
+  X(0x69, "ADC", ADC, IMM, 2) \
+  X(0x6A, "ROR", ROR, IMP, 2) \
+  X(0x6B, "???", ILL, IMP, 2) \
+  X(0x6C, "JMP", JMP, IND, 5) \
+  X(0x6D, "ADC", ADC, ABS, 4) \
+  X(0x6E, "ROR", ROR, ABS, 6) \
+  X(0x6F, "???", ILL, IMP, 6) \
+  X(0x70, "BVS", BVS, REL, 2) \
+  X(0x71, "ADC", ADC, IZY, 5) \
+  X(0x72, "???", ILL, IMP, 2) \
+  X(0x73, "???", ILL, IMP, 8) \
+  X(0x74, "???", ILL, IMP, 4) \
+  X(0x75, "ADC", ADC, ZPX, 4) \
+  X(0x76, "ROR", ROR, ZPX, 6) \
+  X(0x77, "???", ILL, IMP, 6) \
+  X(0x78, "SEI", SEI, IMP, 2) \
+  X(0x79, "ADC", ADC, ABY, 4) \
+  X(0x7A, "???", ILL, IMP, 2) \
+  X(0x7B, "???", ILL, IMP, 7) \
+  X(0x7C, "???", ILL, IMP, 4) \
+  X(0x7D, "ADC", ADC, ABX, 4) \
+  X(0x7E, "ROR", ROR, ABX, 7) \
+  X(0x7F, "???", ILL, IMP, 7) \
+  X(0x80, "???", ILL, IMP, 2) \
+  X(0x81, "STA", STA, IZX, 6) \
+  X(0x82, "???", ILL, IMP, 2) \
+  X(0x83, "???", ILL, IMP, 6) \
+  X(0x84, "STY", STY, ZP0, 3) \
+  X(0x85, "STA", STA, ZP0, 3) \
+  X(0x86, "STX", STX, ZP0, 3) \
+  X(0x87, "???", ILL, IMP, 3) \
+  X(0x88, "DEY", DEY, IMP, 2) \
+  X(0x89, "???", STA, IMP, 2) \
+  X(0x8A, "TXA", TXA, IMP, 2) \
+  X(0x8B, "???", ILL, IMP, 2) \
+  X(0x8C, "STY", STY, ABS, 4) \
+  X(0x8D, "STA", STA, ABS, 4) \
+  X(0x8E, "STX", STX, ABS, 4) \
+  X(0x8F, "???", ILL, IMP, 4) \
+  X(0x90, "BCC", BCC, REL, 2) \
+  X(0x91, "STA", STA, IZY, 6) \
+  X(0x92, "???", ILL, IMP, 2) \
+  X(0x93, "???", ILL, IMP, 6) \
+  X(0x94, "STY", STY, ZPX, 4) \
+  X(0x95, "STA", STA, ZPX, 4) \
+  X(0x96, "STX", STX, ZPY, 4) \
+  X(0x97, "???", ILL, IMP, 4) \
+  X(0x98, "TYA", TYA, IMP, 2) \
+  X(0x99, "STA", STA, ABY, 5) \
+  X(0x9A, "TXS", TXS, IMP, 2) \
+  X(0x9B, "???", ILL, IMP, 5) \
+  X(0x9C, "???", STY, IMP, 5) \
+  X(0x9D, "STA", STA, ABX, 5) \
+  X(0x9E, "???", STX, IMP, 5) \
+  X(0x9F, "???", ILL, IMP, 5) \
+  X(0xA0, "LDY", LDY, IMM, 2) \
+  X(0xA1, "LDA", LDA, IZX, 6) \
+  X(0xA2, "LDX", LDX, IMM, 2) \
+  X(0xA3, "???", ILL, IMP, 6) \
+  X(0xA4, "LDY", LDY, ZP0, 3) \
+  X(0xA5, "LDA", LDA, ZP0, 3) \
+  X(0xA6, "LDX", LDX, ZP0, 3) \
+  X(0xA7, "???", ILL, IMP, 3) \
+  X(0xA8, "TAY", TAY, IMP, 2) \
+  X(0xA9, "LDA", LDA, IMM, 2) \
+  X(0xAA, "TAX", TAX, IMP, 2) \
+  X(0xAB, "???", ILL, IMP, 2) \
+  X(0xAC, "LDY", LDY, ABS, 4) \
+  X(0xAD, "LDA", LDA, ABS, 4) \
+  X(0xAE, "LDX", LDX, ABS, 4) \
+  X(0xAF, "???", ILL, IMP, 4) \
+  X(0xB0, "BCS", BCS, REL, 2) \
+  X(0xB1, "LDA", LDA, IZY, 5) \
+  X(0xB2, "???", ILL, IMP, 2) \
+  X(0xB3, "???", ILL, IMP, 5) \
+  X(0xB4, "LDY", LDY, ZPX, 4) \
+  X(0xB5, "LDA", LDA, ZPX, 4) \
+  X(0xB6, "LDX", LDX, ZPY, 4) \
+  X(0xB7, "???", ILL, IMP, 4) \
+  X(0xB8, "CLV", CLV, IMP, 2) \
+  X(0xB9, "LDA", LDA, ABY, 4) \
+  X(0xBA, "TSX", TSX, IMP, 2) \
+  X(0xBB, "???", ILL, IMP, 4) \
+  X(0xBC, "LDY", LDY, ABX, 4) \
+  X(0xBD, "LDA", LDA, ABX, 4) \
+  X(0xBE, "LDX", LDX, ABY, 4) \
+  X(0xBF, "???", ILL, IMP, 4) \
+  X(0xC0, "CPY", CPY, IMM, 2) \
+  X(0xC1, "CMP", CMP, IZX, 6) \
+  X(0xC2, "???", ILL, IMP, 2) \
+  X(0xC3, "???", ILL, IMP, 8) \
+  X(0xC4, "CPY", CPY, ZP0, 3) \
+  X(0xC5, "CMP", CMP, ZP0, 3) \
+  X(0xC6, "DEC", DEC, ZP0, 5) \
+  X(0xC7, "???", ILL, IMP, 5) \
+  X(0xC8, "INY", INY, IMP, 2) \
+  X(0xC9, "CMP", CMP, IMM, 2) \
+  X(0xCA, "DEX", DEX, IMP, 2) \
+  X(0xCB, "???", ILL, IMP, 2) \
+  X(0xCC, "CPY", CPY, ABS, 4) \
+  X(0xCD, "CMP", CMP, ABS, 4) \
+  X(0xCE, "DEC", DEC, ABS, 6) \
+  X(0xCF, "???", ILL, IMP, 6) \
+  X(0xD0, "BNE", BNE, REL, 2) \
+  X(0xD1, "CMP", CMP, IZY, 5) \
+  X(0xD2, "???", ILL, IMP, 2) \
+  X(0xD3, "???", ILL, IMP, 8) \
+  X(0xD4, "???", ILL, IMP, 4) \
+  X(0xD5, "CMP", CMP, ZPX, 4) \
+  X(0xD6, "DEC", DEC, ZPX, 6) \
+  X(0xD7, "???", ILL, IMP, 6) \
+  X(0xD8, "CLD", CLD, IMP, 2) \
+  X(0xD9, "CMP", CMP, ABY, 4) \
+  X(0xDA, "NOP", NOP, IMP, 2) \
+  X(0xDB, "???", ILL, IMP, 7) \
+  X(0xDC, "???", ILL, IMP, 4) \
+  X(0xDD, "CMP", CMP, ABX, 4) \
+  X(0xDE, "DEC", DEC, ABX, 7) \
+  X(0xDF, "???", ILL, IMP, 7) \
+  X(0xE0, "CPX", CPX, IMM, 2) \
+  X(0xE1, "SBC", SBC, IZX, 6) \
+  X(0xE2, "???", ILL, IMP, 2) \
+  X(0xE3, "???", ILL, IMP, 8) \
+  X(0xE4, "CPX", CPX, ZP0, 3) \
+  X(0xE5, "SBC", SBC, ZP0, 3) \
+  X(0xE6, "INC", INC, ZP0, 5) \
+  X(0xE7, "???", ILL, IMP, 5) \
+  X(0xE8, "INX", INX, IMP, 2) \
+  X(0xE9, "SBC", SBC, IMM, 2) \
+  X(0xEA, "NOP", NOP, IMP, 2) \
+  X(0xEB, "???", ILL, IMP, 2) \
+  X(0xEC, "CPX", CPX, ABS, 4) \
+  X(0xED, "SBC", SBC, ABS, 4) \
+  X(0xEE, "INC", INC, ABS, 6) \
+  X(0xEF, "???", ILL, IMP, 6) \
+  X(0xF0, "BEQ", BEQ, REL, 2) \
+  X(0xF1, "SBC", SBC, IZY, 5) \
+  X(0xF2, "???", ILL, IMP, 2) \
+  X(0xF3, "???", ILL, IMP, 8) \
+  X(0xF4, "???", ILL, IMP, 4) \
+  X(0xF5, "SBC", SBC, ZPX, 4) \
+  X(0xF6, "INC", INC, ZPX, 6) \
+  X(0xF7, "???", ILL, IMP, 6) \
+  X(0xF8, "SED", SED, IMP, 2) \
+  X(0xF9, "SBC", SBC, ABY, 4) \
+  X(0xFA, "NOP", NOP, IMP, 2) \
+  X(0xFB, "???", ILL, IMP, 7) \
+  X(0xFC, "???", ILL, IMP, 4) \
+  X(0xFD, "SBC", SBC, ABX, 4) \
+  X(0xFE, "INC", INC, ABX, 7) \
+  X(0xFF, "???", ILL, IMP, 7)
+
+#define X(code, mnemonic, op, mode, cycles) [code] = {mnemonic, ADDR_MODE_##mode, cycles},
+static Instruction instructions[] = {INSTRUCTIONS(X)};
+#undef X
 
 #endif // __INSTRUCTIONS_H__
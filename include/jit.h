@@ -0,0 +1,48 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include "common.h"
+#include "cpu.h"
+
+/** hits on a rom address before a block is compiled from it */
+#define JIT_THRESHOLD 16
+
+/** longest block compiled, in instructions */
+#define JIT_BLOCK_LENGTH 32
+
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+
+/**
+ * compiled code runs from cpu->pc and returns the cycles it took, never
+ * going past the budget it is given
+ */
+typedef uint32_t (*JitCode)(CPU *cpu, uint64_t budget);
+
+typedef struct {
+  JitCode code;
+
+  /** rom page and rom version the block was compiled against */
+  uint8_t *source;
+  uint32_t version;
+
+  uint16_t hits;
+  /** the most cycles a single pass through the block can take */
+  uint16_t max_cycles;
+  bool failed;
+} JitBlock;
+
+typedef struct Jit {
+  /** one block per address in $8000-$FFFF */
+  JitBlock blocks[0x8000];
+
+  /** executable code, flushed as a whole when it fills up */
+  uint8_t *buffer;
+  uint32_t buffer_used;
+} Jit;
+
+bool jit_enable(CPU *cpu);
+void jit_disable(CPU *cpu);
+void jit_run(CPU *cpu);
+uint8_t jit_step(CPU *cpu);
+
+#endif // __JIT_H__
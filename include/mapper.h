@@ -11,6 +11,9 @@ typedef enum {
   MIRRORING_FOUR_SCREEN
 } MirrorMode;
 
+#define PRG_MEMORY_SIZE (0x4000 * 64)
+#define CHR_TILES (0x2000 * 64 / 16)
+
 typedef struct Mapper {
   uint8_t *(*prg_read)(struct Mapper *, uint16_t);
   bool (*prg_write)(struct Mapper *, uint16_t, uint8_t);
@@ -24,11 +27,18 @@ typedef struct Mapper {
 
   uint32_t prg_rom_size;
   uint8_t prg_banks;
-  uint8_t prg_memory[0x4000 * 64];
+  uint8_t prg_memory[PRG_MEMORY_SIZE];
 
   uint32_t chr_rom_size;
   uint8_t chr_banks;
-  uint8_t chr_memory[0x2000 * 64];
+  uint8_t chr_memory[CHR_TILES * 16];
+
+  /** bumped whenever the prg banks are switched */
+  uint32_t prg_version;
+  /** bumped whenever the chr banks are switched */
+  uint32_t chr_version;
+  /** tiles written since the ppu last decoded them */
+  bool chr_dirty[CHR_TILES];
 
   uint8_t mirror_mode;
 
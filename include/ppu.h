@@ -3,6 +3,9 @@
 
 #include "common.h"
 #include "mapper.h"
+#include "scheduler.h"
+
+typedef enum { PIXEL_FORMAT_RGBA32, PIXEL_FORMAT_RGB565, PIXEL_FORMAT_GRAY8 } PixelFormat;
 
 typedef struct {
   uint8_t y;
@@ -11,6 +14,31 @@ typedef struct {
   uint8_t x;
 } Sprite;
 
+/**
+ * Debug views of the pattern tables and of the four nametables, allocated
+ * only while they are shown. Each update redraws only the tiles whose chr,
+ * bank, palette or nametable entry changed since the last one.
+ */
+typedef struct {
+  uint32_t pattern_tables[2][128 * 128];
+  uint32_t nametables[480 * 512];
+
+  /** what the views were last drawn from */
+  bool drawn;
+  uint8_t chr[512][16];
+  bool chr_changed[512];
+  uint8_t palette[32];
+  uint8_t pattern_palette;
+  uint8_t pattern_background;
+  uint16_t tiles[4][960];
+} PPUDebug;
+
+/**
+ * Thread composing the pixels of the lines the ppu records, see
+ * ppu_worker_start
+ */
+typedef struct PPUWorker PPUWorker;
+
 typedef union {
   struct {
     uint16_t coarse_x : 5;
@@ -25,12 +53,36 @@ typedef union {
 } PPUAddress;
 
 typedef struct {
-  uint8_t raw_nametable[2 * 1024];
+  uint8_t raw_nametable[4 * 1024];
   uint8_t palette[32];
 
-  uint32_t framebuffer[256 * 240];
-  uint32_t nametable[2][256 * 240];
-  uint32_t pattern_table[2][128 * 128];
+  /**
+   * color each of the 32 palette entries draws with, mirrors resolved and
+   * grayscale applied. refreshed on palette and mask writes
+   */
+  uint8_t palette_colors[32];
+
+  /**
+   * the 1KB page behind each nametable, remapped only when the mapper
+   * switches mirroring. four screen carts get all four pages
+   */
+  uint8_t *nametables[4];
+  uint8_t mirror_mode;
+
+  /**
+   * palette indices as rendered and the color emphasis bits of each line,
+   * turned into colors by ppu_convert_frame only when they are shown
+   */
+  uint8_t framebuffer[256 * 240];
+  uint8_t emphasis[240];
+
+  /**
+   * set before a frame that is not going to be shown. the ppu then keeps
+   * only what the cpu and the mapper can see: vblank, nmi, scanline clocks,
+   * scroll and status flags, composing pixels only on lines where sprite
+   * zero could hit
+   */
+  bool skip_render;
 
   uint8_t frame_complete;
   uint16_t cycle;
@@ -48,6 +100,8 @@ typedef struct {
 
     uint8_t reg;
   } status;
+  /** flags the last read of the status register returned */
+  uint8_t status_read;
 
   union {
     struct {
@@ -101,16 +155,49 @@ typedef struct {
 
   Sprite sprite_scanline[8];
   uint8_t sprite_count;
-  uint8_t sprite_shifter_pattern_lo[8];
-  uint8_t sprite_shifter_pattern_hi[8];
+  bool sprite_zero;
+
+  /**
+   * sprite pixels of the line being drawn, one per x, already sorted by
+   * priority. 0 is transparent
+   */
+  uint8_t sprite_line[256];
+
+  /**
+   * dots executed since power on. the ppu only runs when something needs it
+   * to, and schedules itself for the next nmi, mapper irq or frame end
+   */
+  uint64_t dot;
+
+  /**
+   * chr memory decoded to one pixel per byte, as stored and flipped
+   * horizontally, and the first tile of each 1KB pattern table bank
+   */
+  uint8_t chr_tiles[2][CHR_TILES][8][8];
+  uint32_t chr_banks[8];
+  uint32_t chr_version;
+
+  PPUDebug *debug;
+  PPUWorker *worker;
 
   Mapper *mapper;
+  Scheduler *scheduler;
 } PPU;
 
-void ppu_init(PPU *ppu, Mapper *mapper, uint8_t mirroring);
+void ppu_init(PPU *ppu, Mapper *mapper, Scheduler *scheduler, uint8_t mirroring);
 void ppu_step(PPU *ppu);
+void ppu_run(PPU *ppu, uint64_t dot);
+uint64_t ppu_next_event(PPU *ppu);
+void ppu_schedule(PPU *ppu);
+uint64_t ppu_status_stable_until(PPU *ppu);
 uint8_t ppu_control_read(PPU *ppu, uint16_t addr, bool readonly);
 void ppu_control_write(PPU *ppu, uint16_t addr, uint8_t data);
-uint32_t *ppu_get_pattern_table(PPU *ppu, uint8_t i, uint8_t palette);
+bool ppu_debug_open(PPU *ppu);
+void ppu_debug_close(PPU *ppu);
+void ppu_debug_update(PPU *ppu, uint8_t palette);
+void ppu_convert_frame(PPU *ppu, PixelFormat format, void *pixels, int pitch);
+bool ppu_worker_start(PPU *ppu);
+void ppu_worker_stop(PPU *ppu);
+void ppu_worker_wait(PPU *ppu);
 
 #endif // __PPU_H__
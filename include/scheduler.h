@@ -0,0 +1,43 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "common.h"
+
+typedef enum {
+  EVENT_PPU,       // nmi, mapper scanline irq and frame end
+  EVENT_APU_FRAME, // frame sequencer step
+  EVENT_DMC,       // dmc fetch of the last sample byte
+  EVENT_DMA,       // oam dma completion
+  EVENT_COUNT
+} EventType;
+
+typedef struct {
+  uint64_t deadline;
+  EventType type;
+} Event;
+
+typedef struct {
+  /** master clock, in cpu cycles since power on */
+  uint64_t clock;
+
+  /**
+   * the cpu runs freely until the clock reaches this. it may be earlier than
+   * the first event, but never later
+   */
+  uint64_t next;
+
+  /** binary min-heap of pending events */
+  Event heap[EVENT_COUNT];
+  uint8_t count;
+
+  /** position of each event type in the heap, -1 when not scheduled */
+  int8_t index[EVENT_COUNT];
+} Scheduler;
+
+void scheduler_init(Scheduler *scheduler);
+void scheduler_schedule(Scheduler *scheduler, EventType type, uint64_t deadline);
+void scheduler_cancel(Scheduler *scheduler, EventType type);
+bool scheduler_pop(Scheduler *scheduler, EventType *type);
+void scheduler_break(Scheduler *scheduler);
+
+#endif // __SCHEDULER_H__
@@ -1,5 +1,9 @@
 #include "apu.h"
-#include <SDL2/SDL.h>
+
+#include <math.h>
+#include <string.h>
+
+#define PI 3.14159265358979323846
 
 const uint8_t DUTY_CYCLE_TABLE[4][8] = {{0, 1, 0, 0, 0, 0, 0, 0},
                                         {0, 1, 1, 0, 0, 0, 0, 0},
@@ -17,9 +21,54 @@ const uint8_t TRIANGLE_TABLE[] = {0xF, 0xE, 0xD, 0xC, 0xB, 0xA, 0x9, 0x8, 0x7, 0
 const uint16_t NOISE_PERIOD_TABLE[] = {4,   8,   16,  32,  64,  96,   128,  160,
                                        202, 254, 380, 508, 762, 1016, 2034, 4068};
 
+#define FRAME_QUARTER 0x01 // envelopes and linear counter
+#define FRAME_HALF 0x02    // length counters and sweeps
+#define FRAME_IRQ 0x04
+#define FRAME_RESTART 0x08
+
+typedef struct {
+  uint16_t cycle;
+  uint8_t clocks;
+} FrameStep;
+
+/** cpu cycles into the sequence of every step, in 4-step and 5-step mode */
+const FrameStep FRAME_SEQUENCES[2][6] = {
+    {{7457, FRAME_QUARTER},
+     {14913, FRAME_QUARTER | FRAME_HALF},
+     {22371, FRAME_QUARTER},
+     {29829, FRAME_QUARTER | FRAME_HALF | FRAME_IRQ},
+     {29830, FRAME_RESTART}},
+    {{7457, FRAME_QUARTER},
+     {14913, FRAME_QUARTER | FRAME_HALF},
+     {22371, FRAME_QUARTER},
+     {29829, 0},
+     {37281, FRAME_QUARTER | FRAME_HALF},
+     {37282, FRAME_RESTART}}};
+
 const uint16_t DMC_PERIOD_TABLE[] = {428, 380, 340, 320, 286, 254, 226, 214,
                                      190, 160, 142, 128, 106, 84,  72,  54};
 
+/** band-limited impulses for every fractional position of a step */
+static float blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+
+static void apu_schedule(APU *apu);
+static void apu_mix(APU *apu);
+
+/**
+ * Clocks a timer that reloads with period after reaching 0 and returns how
+ * many times it did.
+ */
+static inline uint64_t timer_advance(uint16_t *timer, uint16_t period, uint64_t clocks) {
+  if (clocks <= *timer) {
+    *timer -= clocks;
+    return 0;
+  }
+
+  clocks -= *timer + 1;
+  *timer = period - clocks % (period + 1);
+  return 1 + clocks / (period + 1);
+}
+
 uint8_t pulse_output(Pulse *pulse) {
   bool value = DUTY_CYCLE_TABLE[pulse->duty_cycle][pulse->duty_value];
   if (!pulse->enabled || !value ||
@@ -33,13 +82,16 @@ uint8_t pulse_output(Pulse *pulse) {
   return pulse->envelope.enabled ? pulse->envelope.value : pulse->envelope.period;
 }
 
-void pulse_step(Pulse *pulse) {
-  if (pulse->timer) {
-    pulse->timer--;
-  } else {
-    pulse->timer = pulse->timer_period;
-    pulse->duty_value = (pulse->duty_value + 1) % 8;
-  }
+/** whether the output follows the duty cycle, it is 0 otherwise */
+static bool pulse_audible(Pulse *pulse) {
+  uint8_t volume = pulse->envelope.enabled ? pulse->envelope.value : pulse->envelope.period;
+  return pulse->enabled && pulse->length_counter.value > 0 && pulse->timer_period >= 8 &&
+         pulse->timer_period <= 0x7FF && volume > 0;
+}
+
+void pulse_advance(Pulse *pulse, uint64_t clocks) {
+  uint64_t steps = timer_advance(&pulse->timer, pulse->timer_period, clocks);
+  pulse->duty_value = (pulse->duty_value + steps) % 8;
 }
 
 void pulse_sweep(Pulse *pulse) {
@@ -76,16 +128,20 @@ uint8_t triangle_output(Triangle *triangle) {
     return 0;
   }
 
+  // ultrasonic periods would be filtered out anyway, hold the midpoint instead
+  if (triangle->timer_period < 2) return 7;
+
   return TRIANGLE_TABLE[triangle->duty_value];
 }
 
-void triangle_step(Triangle *triangle) {
-  if (triangle->timer_value) {
-    triangle->timer_value--;
-  } else {
-    triangle->timer_value = triangle->timer_period;
-    triangle->duty_value = (triangle->duty_value + 1) % 32;
-  }
+static bool triangle_audible(Triangle *triangle) {
+  return triangle->enabled && triangle->length_counter.value > 0 &&
+         triangle->linear_counter_value > 0 && triangle->timer_period >= 2;
+}
+
+void triangle_advance(Triangle *triangle, uint64_t clocks) {
+  uint64_t steps = timer_advance(&triangle->timer_value, triangle->timer_period, clocks);
+  triangle->duty_value = (triangle->duty_value + steps) % 32;
 }
 
 void triangle_counter_step(Triangle *triangle) {
@@ -107,14 +163,19 @@ uint8_t noise_output(Noise *noise) {
   return noise->envelope.enabled ? noise->envelope.value : noise->envelope.period;
 }
 
-void noise_step(Noise *noise) {
-  if (noise->timer_value == 0) {
-    noise->timer_value = noise->timer_period;
+static bool noise_audible(Noise *noise) {
+  uint8_t volume = noise->envelope.enabled ? noise->envelope.value : noise->envelope.period;
+  return noise->enabled && noise->length_counter.value > 0 && volume > 0;
+}
+
+void noise_advance(Noise *noise, uint64_t clocks) {
+  uint64_t steps = timer_advance(&noise->timer_value, noise->timer_period, clocks);
+
+  // the shift register has no shortcut, it is shifted once per step
+  while (steps--) {
     uint8_t feedback = noise->shift_register ^ (noise->shift_register >> (noise->mode ? 6 : 1));
     noise->shift_register >>= 1;
     noise->shift_register |= (feedback & 0x1) << 14;
-  } else {
-    noise->timer_value--;
   }
 }
 
@@ -134,8 +195,9 @@ void dmc_reader_step(APU *apu) {
       if (dmc->loop) {
         dmc->current_length = dmc->sample_length;
         dmc->current_address = dmc->sample_address;
-      } else {
+      } else if (dmc->irq_enabled) {
         dmc->irq_active = true;
+        scheduler_break(apu->scheduler);
       }
     }
   }
@@ -165,6 +227,18 @@ void dmc_step(APU *apu) {
   }
 }
 
+/**
+ * Cycle of the next dmc step that changes its output or fetches a byte, given
+ * the cycle of the next timer clock.
+ */
+static uint64_t dmc_next_edge(DMC *dmc, uint64_t clock) {
+  if (!dmc->enabled) return UINT64_MAX;
+  if (dmc->bits_remaining > 0) return clock + 2 * dmc->timer_value;
+  if (dmc->current_length > 0) return clock;
+
+  return UINT64_MAX;
+}
+
 void envelope_step(Envelope *envelope) {
   if (envelope->start) {
     envelope->start = false;
@@ -209,26 +283,49 @@ static inline void step_length_and_sweep(APU *apu) {
   pulse_sweep_step(&apu->pulses[1]);
 }
 
-void apu_init(APU *apu, Mapper *mapper) {
-  apu->mapper = mapper;
+static void blip_init(void) {
+  for (int phase = 0; phase < BLIP_PHASES; phase++) {
+    float *kernel = blip_kernel[phase];
+    double sum = 0;
 
-  SDL_AudioSpec audio_spec;
-  audio_spec.freq = 44100;
-  audio_spec.format = AUDIO_F32SYS;
-  audio_spec.channels = 2;
-  audio_spec.samples = SAMPLES;
-  audio_spec.callback = NULL;
-  audio_spec.userdata = apu;
+    // windowed sinc cut off a bit below nyquist, centered on the step
+    for (int i = 0; i < BLIP_WIDTH; i++) {
+      double x = i - (BLIP_WIDTH / 2 - 1) - (double)phase / BLIP_PHASES;
+      double window = 0.42 + 0.5 * cos(PI * x / (BLIP_WIDTH / 2)) +
+                      0.08 * cos(2 * PI * x / (BLIP_WIDTH / 2));
+      double sinc = x == 0 ? 0.9 : sin(0.9 * PI * x) / (PI * x);
 
-  SDL_AudioSpec obtained_spec;
-  SDL_OpenAudio(&audio_spec, &obtained_spec);
-  SDL_PauseAudio(0);
+      kernel[i] = sinc * window;
+      sum += kernel[i];
+    }
+
+    // every step must add up to its full height
+    for (int i = 0; i < BLIP_WIDTH; i++) {
+      kernel[i] /= sum;
+    }
+  }
+}
+
+void apu_init(APU *apu, Mapper *mapper, Scheduler *scheduler) {
+  apu->mapper = mapper;
+  apu->scheduler = scheduler;
+
+  apu->sink.write = NULL;
+  apu->sink.userdata = NULL;
 
   apu->buffer_index = 0;
   for (int i = 0; i < SAMPLES; i++) {
     apu->buffer[i] = 0;
   }
 
+  blip_init();
+  memset(apu->blip, 0, sizeof(apu->blip));
+  apu->blip_level = 0;
+  apu->blip_position = 0;
+  apu->blip_cycle = 0;
+  apu->blip_factor = 0;
+  apu->output = 0;
+
   for (int i = 0; i < 31; i++) {
     apu->pulse_table[i] = 95.52 / (8128.0 / (float)i + 100);
   }
@@ -242,11 +339,18 @@ void apu_init(APU *apu, Mapper *mapper) {
 
   apu->noise.shift_register = 1;
 
+  apu->cycles = 0;
+  apu_set_sample_rate(apu, SAMPLE_RATE);
+
+  apu->frame_counter = 0;
+  apu->frame_deadline = FRAME_SEQUENCES[0][0].cycle;
   apu->frame_step = 0;
 
   apu->frame_irq_active = false;
   apu->dmc.irq_active = false;
   apu->dmc.bits_remaining = 0;
+
+  apu_schedule(apu);
 }
 
 void apu_write(APU *apu, uint16_t address, uint8_t value) {
@@ -343,16 +447,27 @@ void apu_write(APU *apu, uint16_t address, uint8_t value) {
     apu->frame_counter = value;
     // clear interrupt flag
     if (apu->frame_counter & 0x40) apu->frame_irq_active = false;
-    if (value == 0) apu->frame_irq_active = true;
 
+    // 5-step mode clocks everything right away
+    if (apu->frame_counter & 0x80) {
+      step_envelopes(apu);
+      step_length_and_sweep(apu);
+    }
+
+    // the sequence starts over 3 or 4 cycles later, whether the write lands on an apu cycle
+    apu->frame_step = 0;
+    apu->frame_deadline = apu->cycles + 3 + (apu->cycles & 1) +
+                          FRAME_SEQUENCES[apu->frame_counter >> 7][0].cycle;
     break;
   }
+
+  // the dmc may have been started, stopped or had its irq toggled
+  apu_schedule(apu);
+  apu_mix(apu);
 }
 
 uint8_t apu_read(APU *apu, uint16_t address) {
   if (address == 0x4015) {
-    apu->frame_irq_active = false;
-
     uint8_t value = 0;
     value |= apu->pulses[0].length_counter.value > 0 ? 0x01 : 0;
     value |= apu->pulses[1].length_counter.value > 0 ? 0x02 : 0;
@@ -361,71 +476,215 @@ uint8_t apu_read(APU *apu, uint16_t address) {
     value |= apu->dmc.current_length > 0 ? 0x10 : 0;
     value |= apu->frame_irq_active ? 0x40 : 0;
     value |= apu->dmc.irq_active ? 0x80 : 0;
+
+    // reading acknowledges the frame irq, after reporting it
+    apu->frame_irq_active = false;
     return value;
   }
 
   return 0;
 }
 
-void apu_step(APU *apu) {
-  apu->cycles++;
+/**
+ * Cycle of the next timer step that can change the output, at most limit.
+ * Channels that stay silent are not stepped one by one.
+ */
+static uint64_t apu_next_edge(APU *apu, uint64_t limit) {
+  // pulse, noise and dmc timers are clocked on even cycles
+  uint64_t clock = (apu->cycles | 1) + 1;
+  uint64_t edge;
+
+  for (int i = 0; i < 2; i++) {
+    edge = clock + 2 * apu->pulses[i].timer;
+    if (pulse_audible(&apu->pulses[i]) && edge < limit) limit = edge;
+  }
+
+  edge = apu->cycles + 1 + apu->triangle.timer_value;
+  if (triangle_audible(&apu->triangle) && edge < limit) limit = edge;
+
+  edge = clock + 2 * apu->noise.timer_value;
+  if (noise_audible(&apu->noise) && edge < limit) limit = edge;
+
+  edge = dmc_next_edge(&apu->dmc, clock);
+  if (edge < limit) limit = edge;
+
+  return limit;
+}
+
+/**
+ * Clocks every timer up to the given cycle at once.
+ */
+static void apu_clock(APU *apu, uint64_t cycle) {
+  uint64_t clocks = cycle / 2 - apu->cycles / 2;
+  uint64_t clock = (apu->cycles | 1) + 1;
+
+  pulse_advance(&apu->pulses[0], clocks);
+  pulse_advance(&apu->pulses[1], clocks);
+  triangle_advance(&apu->triangle, cycle - apu->cycles);
+  noise_advance(&apu->noise, clocks);
 
-  // clock timers
-  if (apu->cycles % 2 == 0) {
-    pulse_step(&apu->pulses[0]);
-    pulse_step(&apu->pulses[1]);
-    noise_step(&apu->noise);
+  // the dmc reads memory, its edge is stepped like before
+  DMC *dmc = &apu->dmc;
+  if (dmc_next_edge(dmc, clock) == cycle) {
+    dmc->timer_value -= clocks - 1;
     dmc_step(apu);
+  } else if (dmc->enabled) {
+    timer_advance(&dmc->timer_value, dmc->timer_period, clocks);
   }
-  triangle_step(&apu->triangle);
-
-  // clock length counters
-  if (apu->cycles % (1789773 / 240) == 0) {
-    if ((apu->frame_counter >> 7) & 1) { // 5-step
-      switch (apu->frame_step % 5) {
-      case 0: step_envelopes(apu); break;
-      case 1:
-        step_envelopes(apu);
-        step_length_and_sweep(apu);
-        break;
-      case 2: step_envelopes(apu); break;
-      case 3: /* do nothing */ break;
-      case 4:
-        step_envelopes(apu);
-        step_length_and_sweep(apu);
-        break;
-      }
-    } else { // 4-step
-      step_envelopes(apu);
-      if (apu->frame_step & 0x1) {
-        step_length_and_sweep(apu);
-      }
 
-      if ((apu->frame_step & 0x3) == 3 && (apu->frame_counter & 0x40) == 0) {
-        apu->frame_irq_active = true;
-      }
-    }
+  apu->cycles = cycle;
+}
 
+/**
+ * Runs the step of the frame sequencer that is due and moves the deadline to
+ * the next one.
+ */
+static void apu_frame_step(APU *apu) {
+  const FrameStep *sequence = FRAME_SEQUENCES[apu->frame_counter >> 7];
+  const FrameStep *step = &sequence[apu->frame_step];
+
+  if (step->clocks & FRAME_QUARTER) step_envelopes(apu);
+  if (step->clocks & FRAME_HALF) step_length_and_sweep(apu);
+
+  if (step->clocks & FRAME_IRQ && (apu->frame_counter & 0x40) == 0) {
+    apu->frame_irq_active = true;
+    scheduler_break(apu->scheduler);
+  }
+
+  if (step->clocks & FRAME_RESTART) {
+    apu->frame_step = 0;
+    apu->frame_deadline += sequence[0].cycle;
+  } else {
     apu->frame_step++;
+    apu->frame_deadline += sequence[apu->frame_step].cycle - step->cycle;
+  }
+}
+
+static void apu_write_samples(APU *apu) {
+  if (apu->sink.write) {
+    apu->sink.write(apu->sink.userdata, apu->buffer, apu->buffer_index);
+  }
+
+  apu->buffer_index = 0;
+}
+
+/**
+ * Adds a step to the output at the current cycle.
+ */
+static void blip_add_step(APU *apu, float delta) {
+  uint64_t position = apu->blip_position + (apu->cycles - apu->blip_cycle) * apu->blip_factor;
+  const float *kernel = blip_kernel[(uint32_t)position * (uint64_t)BLIP_PHASES >> 32];
+  float *out = &apu->blip[position >> 32];
+
+  for (int i = 0; i < BLIP_WIDTH; i++) {
+    out[i] += kernel[i] * delta;
+  }
+}
+
+/**
+ * Integrates the steps up to the current cycle into output samples.
+ */
+static void blip_flush(APU *apu) {
+  uint64_t position = apu->blip_position + (apu->cycles - apu->blip_cycle) * apu->blip_factor;
+  uint32_t count = position >> 32;
+
+  for (uint32_t i = 0; i < count; i++) {
+    apu->blip_level += apu->blip[i];
+
+    for (int channel = 0; channel < CHANNELS; channel++) {
+      apu->buffer[apu->buffer_index++] = apu->blip_level;
+    }
+
+    if (apu->buffer_index == SAMPLES) apu_write_samples(apu);
+  }
+
+  if (apu->buffer_index > 0) apu_write_samples(apu);
+
+  // keep the tails of the latest steps
+  memmove(apu->blip, apu->blip + count, BLIP_WIDTH * sizeof(float));
+  memset(apu->blip + BLIP_WIDTH, 0, count * sizeof(float));
+
+  apu->blip_position = (uint32_t)position;
+  apu->blip_cycle = apu->cycles;
+}
+
+static void apu_mix(APU *apu) {
+  uint8_t p = pulse_output(&apu->pulses[0]) + pulse_output(&apu->pulses[1]);
+  uint8_t t = triangle_output(&apu->triangle);
+  uint8_t n = noise_output(&apu->noise);
+  uint8_t d = apu->dmc.value;
+
+  float output = apu->pulse_table[p] + apu->tnd_table[3 * t + 2 * n + d];
+  if (output != apu->output) {
+    blip_add_step(apu, output - apu->output);
+    apu->output = output;
   }
+}
+
+/**
+ * Earliest cycle the dmc can raise its irq, i.e. fetch the last byte of a
+ * sample. It is only a lower bound, the event is rescheduled if it is early.
+ */
+static uint64_t dmc_next_event(APU *apu) {
+  DMC *dmc = &apu->dmc;
 
-  // downsample
-  if (apu->cycles % (APU_RATE / SAMPLE_RATE) / 2 == 0) {
-    uint8_t p = pulse_output(&apu->pulses[0]) + pulse_output(&apu->pulses[1]);
-    uint8_t t = triangle_output(&apu->triangle);
-    uint8_t n = noise_output(&apu->noise);
-    uint8_t d = apu->dmc.value;
+  // timer steps, the dmc is clocked every other cycle
+  uint64_t period = dmc->timer_period + 1;
+  uint64_t steps = 0;
 
-    float sample = apu->pulse_table[p] + apu->tnd_table[3 * t + 2 * n + d];
-    apu->buffer[apu->buffer_index++] = sample;
+  if (dmc->bits_remaining > 0) {
+    steps = dmc->timer_value + 1 + (dmc->bits_remaining - 1) * period;
   }
 
-  if (apu->buffer_index >= SAMPLES) {
-    apu->buffer_index = 0;
-    // sync
-    while (SDL_GetQueuedAudioSize(1) > SAMPLES * sizeof(float)) {
-      SDL_Delay(1);
+  steps += (dmc->current_length - 1) * 8 * period;
+
+  return apu->cycles + (steps > 0 ? 2 * steps - 1 : 1);
+}
+
+static void apu_schedule(APU *apu) {
+  scheduler_schedule(apu->scheduler, EVENT_APU_FRAME, apu->frame_deadline);
+
+  DMC *dmc = &apu->dmc;
+  if (dmc->enabled && dmc->irq_enabled && !dmc->loop && dmc->current_length > 0) {
+    scheduler_schedule(apu->scheduler, EVENT_DMC, dmc_next_event(apu));
+  } else {
+    scheduler_cancel(apu->scheduler, EVENT_DMC);
+  }
+}
+
+/**
+ * Runs the apu until it has caught up with the given cpu cycle, jumping from
+ * one output change to the next.
+ */
+void apu_run(APU *apu, uint64_t cycle) {
+  while (apu->cycles < cycle) {
+    apu_clock(apu, apu_next_edge(apu, cycle < apu->frame_deadline ? cycle : apu->frame_deadline));
+
+    if (apu->cycles == apu->frame_deadline) {
+      apu_frame_step(apu);
+
+      // in case nobody ends the frame
+      if ((apu->cycles - apu->blip_cycle) * apu->blip_factor >> 32 > BLIP_SIZE / 2) blip_flush(apu);
     }
-    SDL_QueueAudio(1, apu->buffer, SAMPLES * sizeof(float));
+
+    apu_mix(apu);
   }
+
+  apu_schedule(apu);
 }
+
+/**
+ * Sets how many samples are made per second of emulated time. Frontends nudge
+ * it around SAMPLE_RATE to keep their audio buffer from running dry or over.
+ */
+void apu_set_sample_rate(APU *apu, double rate) {
+  // steps that were already added keep their position
+  apu->blip_position += (apu->cycles - apu->blip_cycle) * apu->blip_factor;
+  apu->blip_cycle = apu->cycles;
+  apu->blip_factor = (uint64_t)(rate * 4294967296.0) / APU_RATE;
+}
+
+/**
+ * Filters the output of the frame down to SAMPLE_RATE and hands it to the sink.
+ */
+void apu_end_frame(APU *apu) { blip_flush(apu); }
@@ -0,0 +1,164 @@
+#include "audio.h"
+
+#include <string.h>
+
+#define AUDIO_FILE_BUFFER (1 << 20)
+#define WAV_HEADER_SIZE 44
+
+void audio_ring_init(AudioRing *ring) {
+  memset(ring->samples, 0, sizeof(ring->samples));
+  ring->head = 0;
+  ring->tail = 0;
+  ring->overruns = 0;
+  ring->underruns = 0;
+}
+
+/**
+ * Queues as many samples as fit and returns how many did, the rest counts as
+ * an overrun. Only called from the producer.
+ */
+uint32_t audio_ring_write(AudioRing *ring, const float *samples, uint32_t count) {
+  uint32_t head = ring->head;
+  uint32_t space = AUDIO_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+
+  if (count > space) {
+    __atomic_store_n(&ring->overruns, ring->overruns + count - space, __ATOMIC_RELAXED);
+    count = space;
+  }
+
+  uint32_t start = head & (AUDIO_RING_SIZE - 1);
+  uint32_t first = count < AUDIO_RING_SIZE - start ? count : AUDIO_RING_SIZE - start;
+
+  memcpy(ring->samples + start, samples, first * sizeof(float));
+  memcpy(ring->samples, samples + first, (count - first) * sizeof(float));
+  __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+/**
+ * Dequeues up to count samples and returns how many there were, the rest
+ * counts as an underrun. Only called from the consumer.
+ */
+uint32_t audio_ring_read(AudioRing *ring, float *samples, uint32_t count) {
+  uint32_t tail = ring->tail;
+  uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+  if (count > available) {
+    __atomic_store_n(&ring->underruns, ring->underruns + count - available, __ATOMIC_RELAXED);
+    count = available;
+  }
+
+  uint32_t start = tail & (AUDIO_RING_SIZE - 1);
+  uint32_t first = count < AUDIO_RING_SIZE - start ? count : AUDIO_RING_SIZE - start;
+
+  memcpy(samples, ring->samples + start, first * sizeof(float));
+  memcpy(samples + first, ring->samples, (count - first) * sizeof(float));
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+/**
+ * Samples queued right now, safe to call from either side.
+ */
+uint32_t audio_ring_count(AudioRing *ring) {
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = value;
+  out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  put_u16(out, value);
+  put_u16(out + 2, value >> 16);
+}
+
+static bool audio_file_write_header(AudioFile *file) {
+  uint8_t header[WAV_HEADER_SIZE];
+  uint32_t data_size = file->samples * sizeof(float);
+
+  memcpy(header, "RIFF", 4);
+  put_u32(header + 4, WAV_HEADER_SIZE - 8 + data_size);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_u32(header + 16, 16);
+  put_u16(header + 20, 3); // ieee float
+  put_u16(header + 22, file->channels);
+  put_u32(header + 24, file->rate);
+  put_u32(header + 28, file->rate * file->channels * sizeof(float));
+  put_u16(header + 32, file->channels * sizeof(float));
+  put_u16(header + 34, 32);
+  memcpy(header + 36, "data", 4);
+  put_u32(header + 40, data_size);
+
+  return fwrite(header, 1, WAV_HEADER_SIZE, file->file) == WAV_HEADER_SIZE;
+}
+
+/**
+ * Opens path for writing. A wav header is written with empty sizes, which
+ * audio_file_close fills in.
+ */
+bool audio_file_open(AudioFile *file, const char *path, AudioFileFormat format,
+                     uint16_t channels, uint32_t rate) {
+  file->file = fopen(path, "wb");
+  if (file->file == NULL) return false;
+
+  // samples are written a frame at a time, let stdio batch them
+  setvbuf(file->file, NULL, _IOFBF, AUDIO_FILE_BUFFER);
+
+  file->format = format;
+  file->channels = channels;
+  file->rate = rate;
+  file->samples = 0;
+  file->truncated = false;
+
+  // the riff size counts the header past its first 8 bytes, whole frames only
+  file->limit = UINT64_MAX;
+  if (format == AUDIO_FILE_WAV) {
+    file->limit = (UINT32_MAX - (WAV_HEADER_SIZE - 8)) / sizeof(float) / channels * channels;
+  }
+
+  if (format == AUDIO_FILE_WAV && !audio_file_write_header(file)) {
+    fclose(file->file);
+    file->file = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Sink write function, userdata is the AudioFile. Samples are stored as
+ * native floats, which is what wav expects on little endian hosts. Once a
+ * wav is full the rest is dropped and truncated is set.
+ */
+void audio_file_write(void *userdata, const float *samples, uint32_t count) {
+  AudioFile *file = userdata;
+
+  if (count > file->limit - file->samples) {
+    count = file->limit - file->samples;
+    file->truncated = true;
+  }
+
+  file->samples += fwrite(samples, sizeof(float), count, file->file);
+}
+
+/**
+ * Flushes and closes the file, returning false if anything failed to be
+ * written.
+ */
+bool audio_file_close(AudioFile *file) {
+  bool ok = !ferror(file->file);
+
+  if (ok && file->format == AUDIO_FILE_WAV) {
+    ok = fseek(file->file, 0, SEEK_SET) == 0 && audio_file_write_header(file);
+  }
+
+  ok = fclose(file->file) == 0 && ok;
+  file->file = NULL;
+
+  return ok;
+}
@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "audio.h"
+#include "emulator.h"
+#include "jit.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_FRAMES 600
+
+/**
+ * Headless frame-throughput benchmark. Runs a ROM for a fixed number of
+ * frames with no video or audio output and reports how fast the core went.
+ * --jit compiles hot rom code to native code, --skip-render runs every frame
+ * the way a fast-forward would, without composing pixels, and
+ * --render-thread composes them on a second thread.
+ *
+ * --audio=FILE renders the sound to a .wav, or to raw float32 for any other
+ * name, and --input=FILE plays scripted input, so soundtracks can be rendered
+ * faster than real time and diffed.
+ */
+
+static Emulator emulator;
+
+/**
+ * A line of an input script: "<frame> <buttons>", where buttons is a hex byte
+ * of controller 1 (a, b, select, start, up, down, left, right from bit 7
+ * down). They are held from that frame until the next line. # starts a
+ * comment.
+ */
+typedef struct {
+  int frame;
+  uint8_t buttons;
+} InputEvent;
+
+static bool input_next(FILE *file, InputEvent *event) {
+  char line[256];
+  unsigned int buttons;
+
+  while (fgets(line, sizeof(line), file)) {
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    if (sscanf(line, "%d %x", &event->frame, &buttons) == 2) {
+      event->buttons = buttons;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  bool jit = false;
+  bool skip_render = false;
+  bool render_thread = false;
+  const char *audio_path = NULL;
+  const char *input_path = NULL;
+
+  for (; argc > 1 && strncmp(argv[argc - 1], "--", 2) == 0; argc--) {
+    if (strcmp(argv[argc - 1], "--jit") == 0) {
+      jit = true;
+    } else if (strcmp(argv[argc - 1], "--skip-render") == 0) {
+      skip_render = true;
+    } else if (strcmp(argv[argc - 1], "--render-thread") == 0) {
+      render_thread = true;
+    } else if (strncmp(argv[argc - 1], "--audio=", 8) == 0) {
+      audio_path = argv[argc - 1] + 8;
+    } else if (strncmp(argv[argc - 1], "--input=", 8) == 0) {
+      input_path = argv[argc - 1] + 8;
+    } else {
+      printf("Unknown option: %s\n", argv[argc - 1]);
+      return 1;
+    }
+  }
+
+  if (argc < 2) {
+    printf("usage: %s <rom> [frames] [--jit] [--skip-render] [--render-thread] "
+           "[--audio=FILE] [--input=FILE]\n",
+           argv[0]);
+    return 1;
+  }
+
+  int frames = argc > 2 ? atoi(argv[2]) : DEFAULT_FRAMES;
+
+  if (frames <= 0) {
+    printf("Invalid frame count: %s\n", argv[2]);
+    return 1;
+  }
+
+  emulator_init(&emulator, argv[1]);
+
+  if (jit && !jit_enable(&emulator.cpu)) {
+    printf("jit is not supported on this platform\n");
+    return 1;
+  }
+
+  if (render_thread && !ppu_worker_start(&emulator.ppu)) {
+    printf("could not start the render thread\n");
+    return 1;
+  }
+
+  emulator.ppu.skip_render = skip_render;
+
+  AudioFile audio;
+  if (audio_path) {
+    size_t length = strlen(audio_path);
+    bool wav = length >= 4 && strcmp(audio_path + length - 4, ".wav") == 0;
+
+    if (!audio_file_open(&audio, audio_path, wav ? AUDIO_FILE_WAV : AUDIO_FILE_RAW, CHANNELS,
+                         SAMPLE_RATE)) {
+      printf("could not open %s\n", audio_path);
+      return 1;
+    }
+
+    emulator.apu.sink.write = audio_file_write;
+    emulator.apu.sink.userdata = &audio;
+  }
+
+  FILE *input = NULL;
+  InputEvent event;
+  bool pending = false;
+  if (input_path) {
+    input = fopen(input_path, "r");
+    if (input == NULL) {
+      printf("could not open %s\n", input_path);
+      return 1;
+    }
+
+    pending = input_next(input, &event);
+  }
+
+  double start = now();
+
+  for (int i = 0; i < frames; i++) {
+    for (; pending && event.frame <= i; pending = input_next(input, &event)) {
+      emulator.controller[0] = event.buttons;
+    }
+
+    emulator_step(&emulator);
+  }
+
+  ppu_worker_wait(&emulator.ppu);
+
+  double elapsed = now() - start;
+
+  if (input) fclose(input);
+
+  if (audio_path && !audio_file_close(&audio)) {
+    printf("could not write %s\n", audio_path);
+    return 1;
+  }
+
+  if (audio_path && audio.truncated) {
+    printf("%s is full at 4GB, the rest of the sound was dropped\n", audio_path);
+  }
+
+  printf("rom: %s\n", argv[1]);
+  printf("frames: %d\n", frames);
+  printf("jit: %s\n", jit ? "on" : "off");
+  printf("render: %s\n", skip_render ? "skipped" : render_thread ? "thread" : "on");
+  printf("audio: %s\n", audio_path ? audio_path : "off");
+  printf("cycles: %llu\n", (unsigned long long)emulator.scheduler.clock);
+  printf("seconds: %.3f\n", elapsed);
+  printf("frames/sec: %.1f\n", frames / elapsed);
+  printf("cycles/sec: %.0f\n", emulator.scheduler.clock / elapsed);
+  printf("ns/frame: %.0f\n", elapsed * 1e9 / frames);
+
+  return 0;
+}
@@ -3,34 +3,83 @@
 
 #include <stdio.h>
 
-void bus_init(Bus *bus, Mapper *mapper, PPU *ppu, APU *apu, uint8_t *controller) {
+void bus_init(Bus *bus, Mapper *mapper, PPU *ppu, APU *apu, Scheduler *scheduler,
+              uint8_t *controller) {
   // reset ram
 
   bus->mapper = mapper;
   bus->ppu = ppu;
   bus->controller = controller;
   bus->apu = apu;
+  bus->scheduler = scheduler;
 
   bus->dma_page = 0x00;
-  bus->dma_data = 0x00;
-  bus->dma_addr = 0x00;
-  bus->dma_dummy = true;
+  bus->dma_request = false;
   bus->dma_transfer = false;
+
+  bus->map_version = 0;
+  bus->rom_version = 0;
+  bus_map_pages(bus);
 }
 
-inline uint8_t bus_read(Bus *bus, uint16_t addr, bool read_only) {
-  if (bus->mapper->prg_read(bus->mapper, addr)) {
-    return *bus->mapper->prg_read(bus->mapper, addr);
-  } else if (addr >= 0x0000 && addr <= 0x1FFF) {
-    return bus->ram[addr & 0x7FFF];
-  } else if (addr >= 0x2000 && addr <= 0x3FFF) {
+/**
+ * Rebuilds the page table from the mapper's current banks. Cartridge pages
+ * are only written directly when they are backed by mapper ram, so writes to
+ * rom still reach the mapper registers.
+ */
+void bus_map_pages(Bus *bus) {
+  Mapper *mapper = bus->mapper;
+
+  for (int page = 0; page < BUS_PAGES; page++) {
+    uint8_t *memory = mapper->prg_read(mapper, page << 8);
+
+    if (memory == NULL && page < 0x20) {
+      memory = bus->ram + ((page & 0x07) << 8);
+    }
+
+    bus->read_pages[page] = memory;
+    bus->write_pages[page] = NULL;
+
+    if (memory == NULL) continue;
+
+    if (page < 0x20 || (memory >= mapper->ram && memory < mapper->ram + sizeof(mapper->ram))) {
+      bus->write_pages[page] = memory;
+    }
+  }
+
+  bus->prg_version = mapper->prg_version;
+  bus->map_version++;
+}
+
+/**
+ * The PPU and APU lag behind the CPU and are only brought up to date when
+ * their state is about to be observed or changed.
+ */
+void bus_sync_ppu(Bus *bus) { ppu_run(bus->ppu, bus->scheduler->clock * 3); }
+
+void bus_sync_apu(Bus *bus) { apu_run(bus->apu, bus->scheduler->clock); }
+
+/**
+ * Whether any source holds the irq line. The mapper is acknowledged through
+ * its registers, the dmc through $4010 or $4015 and the frame counter through
+ * $4015 or $4017.
+ */
+bool bus_irq_line(Bus *bus) {
+  return bus->mapper->irq_active ||
+         (bus->apu && (bus->apu->dmc.irq_active || bus->apu->frame_irq_active));
+}
+
+static uint8_t bus_read_io(Bus *bus, uint16_t addr, bool read_only) {
+  if (addr >= 0x2000 && addr <= 0x3FFF) {
     // ppu range
+    bus_sync_ppu(bus);
     return ppu_control_read(bus->ppu, addr & 0x0007, read_only);
   } else if (addr >= 0x4000 && addr <= 0x4013) {
     // apu range
   } else if (addr == 0x4014) {
     // oam dma
   } else if (addr == 0x4015) {
+    bus_sync_apu(bus);
     return apu_read(bus->apu, addr);
   } else if (addr == 0x4016) {
     // controller 1
@@ -51,23 +100,46 @@ inline uint8_t bus_read(Bus *bus, uint16_t addr, bool read_only) {
   return 0;
 }
 
-void bus_write(Bus *bus, uint16_t addr, uint8_t data) {
+inline uint8_t bus_read(Bus *bus, uint16_t addr, bool read_only) {
+  uint8_t *page = bus->read_pages[addr >> 8];
+
+  if (page) {
+    return page[addr & 0xFF];
+  }
+
+  return bus_read_io(bus, addr, read_only);
+}
+
+static void bus_write_io(Bus *bus, uint16_t addr, uint8_t data) {
+  // mapper registers can switch chr banks, mirroring and dmc sample banks
+  if (addr >= 0x8000) {
+    bus_sync_ppu(bus);
+    bus_sync_apu(bus);
+  }
+
   if (bus->mapper->prg_write(bus->mapper, addr, data)) {
+    // code the cpu has already decoded may have changed
+    if (addr >= 0x8000) {
+      bus->map_version++;
+      bus->rom_version++;
+    }
     return;
-  } else if (addr >= 0x0000 && addr <= 0x1FFF) {
-    bus->ram[addr & 0x7FFF] = data;
   } else if (addr >= 0x2000 && addr <= 0x3FFF) {
     // ppu range
+    bus_sync_ppu(bus);
     ppu_control_write(bus->ppu, addr & 0x0007, data);
   } else if (addr >= 0x4000 && addr <= 0x4013) {
     // apu range
+    bus_sync_apu(bus);
     apu_write(bus->apu, addr, data);
   } else if (addr == 0x4014) {
+    // starts once this instruction is done
     bus->dma_page = data;
-    bus->dma_addr = 0x00;
-    bus->dma_transfer = true;
+    bus->dma_request = true;
+    scheduler_break(bus->scheduler);
   } else if (addr == 0x4015 || addr == 0x4017) {
     // apu range
+    bus_sync_apu(bus);
     apu_write(bus->apu, addr, data);
   } else if (addr == 0x4016) {
     // controller 1
@@ -78,8 +150,22 @@ void bus_write(Bus *bus, uint16_t addr, uint8_t data) {
   } else if (addr >= 0x4018 && addr <= 0x401F) {
     // apu range
   } else if (addr >= 0x4020 && addr <= 0xFFFF) {
-    // mapper range
+    // mapper range, only remapped when the write switched prg banks
+    if (bus->mapper->prg_version != bus->prg_version) {
+      bus_map_pages(bus);
+    }
+  }
+}
+
+inline void bus_write(Bus *bus, uint16_t addr, uint8_t data) {
+  uint8_t *page = bus->write_pages[addr >> 8];
+
+  if (page) {
+    page[addr & 0xFF] = data;
+    return;
   }
+
+  bus_write_io(bus, addr, data);
 }
 
 uint16_t bus_read_wide(Bus *bus, uint16_t addr, bool read_only) {
@@ -89,24 +175,21 @@ uint16_t bus_read_wide(Bus *bus, uint16_t addr, bool read_only) {
   return (hi << 8) | lo;
 }
 
-void bus_dma_transfer(Bus *bus, int cycles) {
-  // add dummy cycle
-  if (bus->dma_dummy) {
-    if (cycles % 2 == 1) {
-      bus->dma_dummy = false;
-    }
-  } else {
-    if (cycles % 2 == 0) {
-      bus->dma_data = bus_read(bus, (bus->dma_page << 8) | bus->dma_addr, false);
-    } else {
-      ((uint8_t *)bus->ppu->oam)[bus->ppu->oam_addr] = bus->dma_data;
-      bus->dma_addr++;
-      bus->ppu->oam_addr++;
-
-      if (bus->dma_addr == 0x00) {
-        bus->dma_transfer = false;
-        bus->dma_dummy = true;
-      }
-    }
+/**
+ * Copies the whole page to oam at once and halts the cpu for the 513 cycles
+ * (514 on an odd cycle) the transfer takes.
+ */
+void bus_dma_transfer(Bus *bus) {
+  bus_sync_ppu(bus);
+
+  for (int i = 0; i < 256; i++) {
+    uint8_t data = bus_read(bus, (bus->dma_page << 8) | i, false);
+    ((uint8_t *)bus->ppu->oam)[bus->ppu->oam_addr++] = data;
   }
+
+  uint64_t clock = bus->scheduler->clock;
+  scheduler_schedule(bus->scheduler, EVENT_DMA, clock + 513 + (clock & 1));
+
+  bus->dma_request = false;
+  bus->dma_transfer = true;
 }
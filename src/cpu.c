@@ -1,68 +1,50 @@
 #include "cpu.h"
 #include "instructions.h"
+#include "jit.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-
-const uint8_t BRANCH_OFF[] = {7, 6, 0, 1};
+#include <string.h>
 
 void cpu_trace(Instruction instruction, CPU* cpu, uint8_t op, uint16_t addr, uint16_t addr2) {
   printf("0x%04X: %02X %s 0x%04X, A: %02X X: %02X Y: %02X\n", addr, op, instruction.mnemonic, addr2, cpu->a, cpu->x, cpu->y);
 }
 
-#define CASE8_4(x)                                                             \
-  x:                                                                           \
-  case x + 4:                                                                  \
-  case x + 8:                                                                  \
-  case x + 12:                                                                 \
-  case x + 16:                                                                 \
-  case x + 20:                                                                 \
-  case x + 24:                                                                 \
-  case x + 28
-
-#define VERT_8(x)                                                              \
-  x:                                                                           \
-  case x + 0x20:                                                               \
-  case x + 0x40:                                                               \
-  case x + 0x60:                                                               \
-  case x + 0x80:                                                               \
-  case x + 0xA0:                                                               \
-  case x + 0xC0:                                                               \
-  case x + 0xE0
-
-#define VERT_4(x)                                                              \
-  x:                                                                           \
-  case x + 0x20:                                                               \
-  case x + 0x40:                                                               \
-  case x + 0x60
-
-#define CASE4(x)                                                               \
-  x:                                                                           \
-  case x + 0x08:                                                               \
-  case x + 0x10:                                                               \
-  case x + 0x18
-
-#define CASE5(x) CASE4(x) : case x + 0x04
-
 #define CHECK_PAGE_CROSSING(addr1, addr2)                                      \
   if ((addr1 & 0xFF00) != (addr2 & 0xFF00)) {                                  \
     cycles++;                                                                  \
   }
 
-#define SET_ZERO_NEGATIVE(value)                                               \
-  cpu_set_flag(cpu, FLAG_ZERO, value == 0x00);                                 \
-  cpu_set_flag(cpu, FLAG_NEGATIVE, (value)&0x80);
+#define SET_ZERO_NEGATIVE(value) flags->n = flags->z = (value);
 
 bool is_opcode_legal(uint8_t opcode) {
   return instructions[opcode].mnemonic[0] != '?';
 }
 
-static inline void push(CPU *cpu, uint8_t data) {
-  bus_write(cpu->bus, 0x0100 + cpu->sp--, data);
+/**
+ * Zero page and the stack page are always plain ram, so they are accessed
+ * straight through pointers cached from the page table
+ */
+static inline uint8_t zp_read(CPU *cpu, uint8_t addr) { return cpu->zero_page[addr]; }
+
+static inline void zp_write(CPU *cpu, uint8_t addr, uint8_t data) {
+  cpu->zero_page[addr] = data;
 }
 
-static inline uint8_t pop(CPU *cpu) {
-  return bus_read(cpu->bus, 0x0100 + ++cpu->sp, false);
+static inline void push(CPU *cpu, uint8_t data) { cpu->stack_page[cpu->sp--] = data; }
+
+static inline uint8_t pop(CPU *cpu) { return cpu->stack_page[++cpu->sp]; }
+
+static inline uint8_t cpu_read(CPU *cpu, uint16_t addr) {
+  uint8_t *page = cpu->bus->read_pages[addr >> 8];
+  return page ? page[addr & 0xFF] : bus_read(cpu->bus, addr, false);
+}
+
+static inline uint16_t cpu_read_wide(CPU *cpu, uint16_t addr) {
+  uint16_t lo = cpu_read(cpu, addr);
+  uint16_t hi = cpu_read(cpu, addr + 1);
+
+  return (hi << 8) | lo;
 }
 
 static inline void cpu_set_flag(CPU *cpu, uint8_t mask, bool value) {
@@ -73,88 +55,125 @@ static inline void cpu_set_flag(CPU *cpu, uint8_t mask, bool value) {
   }
 }
 
-static inline void adc(CPU *cpu, uint8_t data) {
-  uint16_t result = cpu->a + data + (cpu->status & FLAG_CARRY);
-  cpu_set_flag(cpu, FLAG_CARRY, result > 0xFF);
-  cpu_set_flag(cpu, FLAG_ZERO, (result & 0x00FF) == 0);
-  cpu_set_flag(cpu, FLAG_NEGATIVE, result & 0x80);
-  cpu_set_flag(cpu, FLAG_OVERFLOW,
-               (~(cpu->a ^ data) & (cpu->a ^ result)) & 0x80);
+/**
+ * Lazy flags. While the cpu runs, N, Z, C and V live in locals of the
+ * interpreter and status only holds I, D, B and unused. They are packed
+ * into status when something reads it (PHP, BRK, the idle loop check) and
+ * whenever the cpu stops, so status is always whole outside of it.
+ */
+#define FLAGS_LAZY (FLAG_NEGATIVE | FLAG_ZERO | FLAG_CARRY | FLAG_OVERFLOW)
+
+/**
+ * N is bit 7 of the last result, Z is set when the last result is 0, C is
+ * 0 or 1 and V is bit 6 of v
+ */
+typedef struct {
+  uint8_t n;
+  uint8_t z;
+  uint8_t c;
+  uint8_t v;
+} Flags;
+
+static inline uint8_t cpu_status(CPU *cpu, Flags *flags) {
+  return (cpu->status & ~FLAGS_LAZY) | (flags->n & FLAG_NEGATIVE) |
+         (flags->z == 0) << 1 | flags->c | (flags->v & FLAG_OVERFLOW);
+}
+
+static inline void cpu_set_status(CPU *cpu, Flags *flags, uint8_t status) {
+  cpu->status = status;
+  flags->n = status;
+  flags->z = ~status & FLAG_ZERO;
+  flags->c = status & FLAG_CARRY;
+  flags->v = status;
+}
+
+static inline void adc(CPU *cpu, Flags *flags, uint8_t data) {
+  uint16_t result = cpu->a + data + flags->c;
+  flags->c = result >> 8;
+  flags->v = (~(cpu->a ^ data) & (cpu->a ^ result)) >> 1;
   cpu->a = result & 0x00FF;
+  SET_ZERO_NEGATIVE(cpu->a);
 }
 
-static inline uint8_t asl(CPU *cpu, uint8_t data) {
-  uint16_t result = data << 1;
-  cpu_set_flag(cpu, FLAG_CARRY, result & 0xFF00);
-  cpu_set_flag(cpu, FLAG_ZERO, (result & 0x00FF) == 0);
-  cpu_set_flag(cpu, FLAG_NEGATIVE, result & 0x80);
+static inline uint8_t asl(CPU *cpu, Flags *flags, uint8_t data) {
+  uint8_t result = data << 1;
+  flags->c = data >> 7;
+  SET_ZERO_NEGATIVE(result);
 
-  return result & 0x00FF;
+  return result;
 }
 
 /**
  * Zero = A & data
  * status[6,7] = data[6,7]
  */
-static inline void bit(CPU *cpu, uint8_t data) {
-  cpu->status =
-      (cpu->status & 0x3d) | (data & 0xc0) | ((data & cpu->a) == 0) << 1;
+static inline void bit(CPU *cpu, Flags *flags, uint8_t data) {
+  flags->n = data;
+  flags->v = data;
+  flags->z = data & cpu->a;
 }
 
-static inline void brk(CPU *cpu) {
+static inline void brk(CPU *cpu, Flags *flags) {
   push(cpu, (cpu->pc >> 8) & 0x00FF);
   push(cpu, cpu->pc & 0x00FF);
 
   // push status with break set
-  push(cpu, cpu->status | FLAG_BREAK);
+  push(cpu, cpu_status(cpu, flags) | FLAG_BREAK);
 
   cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE, true);
-  cpu->pc = bus_read_wide(cpu->bus, 0xFFFE, false);
+  cpu->pc = cpu_read_wide(cpu, 0xFFFE);
 }
 
-static inline void cmp(CPU *cpu, uint8_t source, uint8_t data) {
-  uint16_t result = source - data;
-  cpu_set_flag(cpu, FLAG_NEGATIVE, result & 0x80);
-  cpu_set_flag(cpu, FLAG_ZERO, result == 0);
+static inline void cmp(CPU *cpu, Flags *flags, uint8_t source, uint8_t data) {
+  uint8_t result = source - data;
+  SET_ZERO_NEGATIVE(result);
 
-  // TODO: understand why carry is <= 0xff
-  cpu_set_flag(cpu, FLAG_CARRY, result <= 0xff);
+  // no borrow
+  flags->c = source >= data;
 }
 
-static inline void eor(CPU *cpu, uint8_t data) {
+static inline void eor(CPU *cpu, Flags *flags, uint8_t data) {
   cpu->a ^= data;
-  cpu_set_flag(cpu, FLAG_NEGATIVE, cpu->a & 0x80);
-  cpu_set_flag(cpu, FLAG_ZERO, cpu->a == 0);
+  SET_ZERO_NEGATIVE(cpu->a);
 }
 
-static inline uint8_t lsr(CPU *cpu, uint8_t data) {
+static inline uint8_t lsr(CPU *cpu, Flags *flags, uint8_t data) {
   uint8_t result = data >> 1;
-  cpu_set_flag(cpu, FLAG_CARRY, data & 0x1);
-  cpu_set_flag(cpu, FLAG_NEGATIVE, false);
-  cpu_set_flag(cpu, FLAG_ZERO, result == 0x00);
+  flags->c = data & 0x1;
+  SET_ZERO_NEGATIVE(result);
   return result;
 }
 
-static inline uint8_t rol(CPU *cpu, uint8_t data) {
-  uint16_t result = data << 1 | (cpu->status & 0x01);
-  cpu_set_flag(cpu, FLAG_CARRY, result & 0xFF00);
-  cpu_set_flag(cpu, FLAG_ZERO, (result & 0x00FF) == 0x00);
-  cpu_set_flag(cpu, FLAG_NEGATIVE, result & 0x80);
-  return result & 0x00FF;
+static inline uint8_t rol(CPU *cpu, Flags *flags, uint8_t data) {
+  uint8_t result = data << 1 | flags->c;
+  flags->c = data >> 7;
+  SET_ZERO_NEGATIVE(result);
+  return result;
 }
 
-static inline uint8_t ror(CPU *cpu, uint8_t data) {
-  uint8_t result = data >> 1 | (cpu->status << 7);
-  cpu_set_flag(cpu, FLAG_CARRY, data & 0x1);
-  cpu_set_flag(cpu, FLAG_ZERO, result == 0x00);
-  cpu_set_flag(cpu, FLAG_NEGATIVE, result & 0x80);
+static inline uint8_t ror(CPU *cpu, Flags *flags, uint8_t data) {
+  uint8_t result = data >> 1 | flags->c << 7;
+  flags->c = data & 0x1;
+  SET_ZERO_NEGATIVE(result);
   return result;
 }
 
-static inline void rti(CPU *cpu) {
-  cpu->status = pop(cpu);
-  cpu->status &= ~FLAG_BREAK;
-  cpu->status &= ~FLAG_UNUSED;
+/**
+ * Stops the run after an instruction that cleared I while the irq line is
+ * held, so the irq is taken at the next instruction boundary rather than at
+ * the next event.
+ */
+static inline void cpu_unmask_irq(CPU *cpu) {
+  Scheduler *scheduler = cpu->bus->scheduler;
+
+  if (scheduler && !(cpu->status & FLAG_INTERRUPT_DISABLE) && bus_irq_line(cpu->bus)) {
+    scheduler_break(scheduler);
+  }
+}
+
+static inline void rti(CPU *cpu, Flags *flags) {
+  cpu_set_status(cpu, flags, pop(cpu) & ~(FLAG_BREAK | FLAG_UNUSED));
+  cpu_unmask_irq(cpu);
 
   cpu->pc = pop(cpu);
   cpu->pc |= (uint16_t)pop(cpu) << 8;
@@ -162,337 +181,615 @@ static inline void rti(CPU *cpu) {
 
 void cpu_init(CPU *cpu, Bus *bus) {
   cpu->bus = bus;
+
+  // decoded against an empty map, revalidated on the first fetch
+  for (int i = 0; i < 128; i++) {
+    cpu->decoded_pages[i] = NULL;
+  }
+
+  memset(cpu->decoded, 0, sizeof(cpu->decoded));
+
+  cpu->map_version = bus->map_version - 1;
+  cpu->rom_version = bus->rom_version;
+  cpu->jit = NULL;
+  cpu->zero_page = bus->write_pages[0];
+  cpu->stack_page = bus->write_pages[1];
+
   cpu_reset(cpu);
 }
 
-// FIXME: improve this
-// this is a hack to prevent from changing the ppu
-#define DATA()                                                                 \
-  (instruction.addressing_mode ? bus_read(cpu->bus, addr, false) : cpu->a)
+/**
+ * Points every page at the decoded instructions of the rom now mapped there.
+ * Banks that were switched out keep theirs, they are only dropped when the
+ * rom itself was written to.
+ */
+static void cpu_revalidate(CPU *cpu) {
+  Bus *bus = cpu->bus;
+  Mapper *mapper = bus->mapper;
+
+  // only loaded rom is ever fetched from, so only that can be stale
+  if (bus->rom_version != cpu->rom_version) {
+    uint32_t size = mapper->prg_rom_size < PRG_MEMORY_SIZE ? mapper->prg_rom_size
+                                                           : PRG_MEMORY_SIZE;
+    memset(cpu->decoded, 0, size * sizeof(DecodedInstruction));
+  }
 
-uint8_t cpu_step(CPU *cpu) {
-  uint8_t opcode = bus_read(cpu->bus, cpu->pc, false);
-  Instruction instruction = instructions[opcode];
+  for (int i = 0; i < 128; i++) {
+    uint8_t *source = bus->write_pages[0x80 + i] ? NULL : bus->read_pages[0x80 + i];
+
+    cpu->decoded_pages[i] = NULL;
+    if (source >= mapper->prg_memory && source < mapper->prg_memory + PRG_MEMORY_SIZE) {
+      cpu->decoded_pages[i] = cpu->decoded + (source - mapper->prg_memory);
+    }
+  }
 
-  uint16_t trace_pc = cpu->pc;
+  cpu->map_version = bus->map_version;
+  cpu->rom_version = bus->rom_version;
 
-  // FIXME: hack to make compiler happy about unused variables
-  cpu->pc = trace_pc + 1;
+  cpu->zero_page = bus->write_pages[0];
+  cpu->stack_page = bus->write_pages[1];
+}
 
-  uint8_t cycles = instruction.cycles;
-  uint8_t addressing_cycles = 0;
-  uint8_t operation_cycles = 0;
+static inline void cpu_write(CPU *cpu, uint16_t addr, uint8_t data) {
+  uint8_t *page = cpu->bus->write_pages[addr >> 8];
 
-  uint16_t addr = 0;
+  if (page) {
+    page[addr & 0xFF] = data;
+  } else {
+    bus_write(cpu->bus, addr, data);
 
-  // Addressing modes
-  switch (instruction.addressing_mode) {
-  case ADDR_MODE_IMP:
-    break;
-  case ADDR_MODE_IMM:
-    addr = cpu->pc++;
-    break;
-  case ADDR_MODE_ZP0:
-    addr = bus_read(cpu->bus, cpu->pc++, false) & 0x00FF;
-    break;
-  case ADDR_MODE_ZPX:
-    addr = (bus_read(cpu->bus, cpu->pc++, false) + cpu->x) & 0x00FF;
-    break;
-  case ADDR_MODE_ZPY:
-    addr = (bus_read(cpu->bus, cpu->pc++, false) + cpu->y) & 0x00FF;
-    break;
-  case ADDR_MODE_ABS:
-    addr = bus_read(cpu->bus, cpu->pc++, false);
-    addr |= (uint16_t)(bus_read(cpu->bus, cpu->pc++, false) << 8);
-    break;
-  case ADDR_MODE_ABX: {
-    addr = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t addr_abs_hi = bus_read(cpu->bus, cpu->pc++, false);
-    addr |= (addr_abs_hi << 8);
-    addr += cpu->x;
-
-    if ((addr & 0xFF00) != (addr_abs_hi << 8))
-      addressing_cycles++;
-    break;
+    // the mapper may have switched prg banks
+    if (cpu->map_version != cpu->bus->map_version) cpu_revalidate(cpu);
   }
-  case ADDR_MODE_ABY: {
-    addr = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t addr_abs_hi = bus_read(cpu->bus, cpu->pc++, false);
-    addr |= (addr_abs_hi << 8);
-    addr += cpu->y;
-
-    if ((addr & 0xFF00) != (addr_abs_hi << 8))
-      addressing_cycles++;
-    break;
+}
+
+/**
+ * Operand bytes that follow each addressing mode's opcode
+ */
+static const uint8_t OPERAND_LENGTH[] = {
+    [ADDR_MODE_IMP] = 0, [ADDR_MODE_IMM] = 1, [ADDR_MODE_ZP0] = 1,
+    [ADDR_MODE_ZPX] = 1, [ADDR_MODE_ZPY] = 1, [ADDR_MODE_REL] = 1,
+    [ADDR_MODE_ABS] = 2, [ADDR_MODE_ABX] = 2, [ADDR_MODE_ABY] = 2,
+    [ADDR_MODE_IND] = 2, [ADDR_MODE_IZX] = 1, [ADDR_MODE_IZY] = 1};
+
+/**
+ * Reads the instruction at pc from the bus, caching it when it comes from
+ * prg rom.
+ */
+static DecodedInstruction cpu_decode(CPU *cpu) {
+  uint16_t pc = cpu->pc;
+  DecodedInstruction decoded;
+
+  decoded.opcode = cpu_read(cpu, pc);
+
+  uint8_t length = OPERAND_LENGTH[instructions[decoded.opcode].addressing_mode];
+
+  decoded.operand = 0;
+  if (length > 0) decoded.operand = cpu_read(cpu, pc + 1);
+  if (length > 1) decoded.operand |= cpu_read(cpu, pc + 2) << 8;
+
+  decoded.size = 1 + length;
+
+  // only rom pages are cached, and only instructions that fit in one
+  DecodedInstruction *page = pc >= 0x8000 ? cpu->decoded_pages[(pc >> 8) - 0x80] : NULL;
+  if (page && (pc & 0xFF) + length <= 0xFF) {
+    page[pc & 0xFF] = decoded;
   }
-  case ADDR_MODE_IND: {
-    uint16_t ptr_lo = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t ptr_hi = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t ptr = (ptr_hi << 8) | ptr_lo;
-
-    // simulate page boundary bug
-    if (ptr_lo == 0x00FF) {
-      addr = (bus_read(cpu->bus, ptr & 0xFF00, false)) << 8 |
-             (bus_read(cpu->bus, ptr, false));
-    } else {
-      addr = bus_read_wide(cpu->bus, ptr, false);
+
+  return decoded;
+}
+
+/**
+ * Fetches the instruction at pc and moves pc past it. Instructions in prg
+ * rom are decoded once and served from the cache, across bank switches,
+ * until the rom is written to.
+ */
+static inline DecodedInstruction cpu_fetch(CPU *cpu) {
+  DecodedInstruction decoded = {0, 0, 0};
+
+  if (cpu->pc >= 0x8000) {
+    DecodedInstruction *page = cpu->decoded_pages[(cpu->pc >> 8) - 0x80];
+    if (page) decoded = page[cpu->pc & 0xFF];
+  }
+
+  if (decoded.size == 0) {
+    decoded = cpu_decode(cpu);
+  }
+
+  cpu->pc += decoded.size;
+  return decoded;
+}
+
+/**
+ * Idle loops. A loop that comes back to the same registers after one pass,
+ * without writing anything and only reading memory that stays put until
+ * the next event, does the very same pass until then. Those passes are
+ * skipped by moving the clock, a whole number of passes at a time, so the
+ * cpu still stops on the instruction it would have stopped on.
+ */
+
+#define IDLE_LENGTH 8
+
+/**
+ * What each operation may do in an idle loop, looked up by opcode through
+ * the op column of the instruction table
+ */
+typedef enum {
+  IDLE_READS,    // registers, flags or a read of the operand
+  IDLE_MODIFIES, // read-modify-write, only idle on the accumulator
+  IDLE_WRITES,   // writes memory, the stack or pc
+  IDLE_JUMPS     // idle when it goes back to the head
+} IdleKind;
+
+#define IDLE_ADC IDLE_READS
+#define IDLE_AND IDLE_READS
+#define IDLE_ASL IDLE_MODIFIES
+#define IDLE_BCC IDLE_READS
+#define IDLE_BCS IDLE_READS
+#define IDLE_BEQ IDLE_READS
+#define IDLE_BIT IDLE_READS
+#define IDLE_BMI IDLE_READS
+#define IDLE_BNE IDLE_READS
+#define IDLE_BPL IDLE_READS
+#define IDLE_BRK IDLE_WRITES
+#define IDLE_BVC IDLE_READS
+#define IDLE_BVS IDLE_READS
+#define IDLE_CLC IDLE_READS
+#define IDLE_CLD IDLE_READS
+#define IDLE_CLI IDLE_READS
+#define IDLE_CLV IDLE_READS
+#define IDLE_CMP IDLE_READS
+#define IDLE_CPX IDLE_READS
+#define IDLE_CPY IDLE_READS
+#define IDLE_DEC IDLE_MODIFIES
+#define IDLE_DEX IDLE_READS
+#define IDLE_DEY IDLE_READS
+#define IDLE_EOR IDLE_READS
+#define IDLE_ILL IDLE_WRITES
+#define IDLE_INC IDLE_MODIFIES
+#define IDLE_INX IDLE_READS
+#define IDLE_INY IDLE_READS
+#define IDLE_JMP IDLE_JUMPS
+#define IDLE_JSR IDLE_WRITES
+#define IDLE_LDA IDLE_READS
+#define IDLE_LDX IDLE_READS
+#define IDLE_LDY IDLE_READS
+#define IDLE_LSR IDLE_MODIFIES
+#define IDLE_NOP IDLE_READS
+#define IDLE_ORA IDLE_READS
+#define IDLE_PHA IDLE_WRITES
+#define IDLE_PHP IDLE_WRITES
+#define IDLE_PLA IDLE_WRITES
+#define IDLE_PLP IDLE_WRITES
+#define IDLE_ROL IDLE_MODIFIES
+#define IDLE_ROR IDLE_MODIFIES
+#define IDLE_RTI IDLE_WRITES
+#define IDLE_RTS IDLE_WRITES
+#define IDLE_SBC IDLE_READS
+#define IDLE_SEC IDLE_READS
+#define IDLE_SED IDLE_READS
+#define IDLE_SEI IDLE_READS
+#define IDLE_STA IDLE_WRITES
+#define IDLE_STX IDLE_WRITES
+#define IDLE_STY IDLE_WRITES
+#define IDLE_TAX IDLE_READS
+#define IDLE_TAY IDLE_READS
+#define IDLE_TSX IDLE_READS
+#define IDLE_TXA IDLE_READS
+#define IDLE_TXS IDLE_READS
+#define IDLE_TYA IDLE_READS
+
+#define X_IDLE(code, mnemonic, op, mode, cycles) [code] = IDLE_##op,
+static const uint8_t IDLE_KINDS[256] = {INSTRUCTIONS(X_IDLE)};
+#undef X_IDLE
+
+/**
+ * Checks that the instructions from head loop straight back to it while
+ * only reading, and adds up the cycles of one pass.
+ */
+static bool cpu_idle_pass(CPU *cpu, uint16_t head, uint32_t *cycles, bool *reads_status) {
+  Bus *bus = cpu->bus;
+  uint16_t pc = head;
+
+  *cycles = 0;
+  *reads_status = false;
+
+  for (int i = 0; i < IDLE_LENGTH; i++) {
+    uint8_t *page = bus->read_pages[pc >> 8];
+    if (page == NULL || (pc & 0xFF) > 0xFD) return false;
+
+    uint8_t opcode = page[pc & 0xFF];
+    Instruction *instruction = &instructions[opcode];
+    IdleKind kind = IDLE_KINDS[opcode];
+    AddressingMode mode = instruction->addressing_mode;
+    uint16_t operand = page[(pc + 1) & 0xFF] | page[(pc + 2) & 0xFF] << 8;
+
+    pc += 1 + OPERAND_LENGTH[mode];
+    *cycles += instruction->cycles;
+
+    if (mode == ADDR_MODE_REL) {
+      uint16_t target = pc + (int8_t)operand;
+      if (target != head) return false;
+
+      *cycles += 1 + ((target & 0xFF00) != (pc & 0xFF00));
+      return true;
+    }
+
+    if (kind == IDLE_JUMPS) return mode == ADDR_MODE_ABS && operand == head;
+    if (kind == IDLE_WRITES) return false;
+
+    if (mode == ADDR_MODE_IMP || mode == ADDR_MODE_IMM) continue;
+
+    // read-modify-write, or an address that depends on the registers
+    if (kind == IDLE_MODIFIES) return false;
+    if (mode != ADDR_MODE_ZP0 && mode != ADDR_MODE_ABS) return false;
+
+    if (mode == ADDR_MODE_ZP0) operand &= 0xFF;
+
+    if (bus->read_pages[operand >> 8]) continue;
+
+    // ppu status, the only register that can be read over and over
+    if (operand >= 0x2000 && operand < 0x4000 && (operand & 0x07) == 2) {
+      *reads_status = true;
+      continue;
     }
 
-    break;
+    return false;
   }
-  case ADDR_MODE_IZX: {
-    uint16_t t = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t lo =
-        bus_read(cpu->bus, (uint16_t)(t + (uint16_t)cpu->x) & 0x00FF, false);
-    uint16_t hi = bus_read(
-        cpu->bus, (uint16_t)(t + (uint16_t)cpu->x + 1) & 0x00FF, false);
-
-    addr = (hi << 8) | lo;
-    break;
+
+  return false;
+}
+
+static void cpu_skip_idle(CPU *cpu) {
+  Scheduler *scheduler = cpu->bus->scheduler;
+  uint32_t cycles;
+  bool reads_status;
+
+  if (!cpu_idle_pass(cpu, cpu->pc, &cycles, &reads_status)) {
+    cpu->idle.rejected = true;
+    return;
   }
-  case ADDR_MODE_IZY: {
-    uint16_t t = bus_read(cpu->bus, cpu->pc++, false);
-    uint16_t lo = bus_read(cpu->bus, t & 0x00FF, false);
-    uint16_t hi = bus_read(cpu->bus, (t + 1) & 0x00FF, false);
-    addr = (hi << 8) | lo;
-    addr += cpu->y;
-
-    if ((addr & 0xFF00) != (hi << 8))
-      addressing_cycles++;
-    break;
+
+  // anything else, like an interrupt, ran in between
+  if (scheduler->clock - cpu->idle.clock != cycles) return;
+
+  uint64_t limit = scheduler->next;
+
+  if (reads_status) {
+    bus_sync_ppu(cpu->bus);
+
+    uint64_t stable = ppu_status_stable_until(cpu->bus->ppu) / 3;
+    if (stable < limit) limit = stable;
   }
-  case ADDR_MODE_REL: {
-    addr = bus_read(cpu->bus, cpu->pc++, false);
-    if (addr & 0x80) {
-      addr |= 0xFF00;
-    }
-    break;
+
+  if (limit > scheduler->clock) {
+    scheduler->clock += (limit - scheduler->clock) / cycles * cycles;
   }
+}
+
+/**
+ * Called when a jump or branch goes back, with the clock past it
+ */
+static inline void cpu_jumped_back(CPU *cpu, Scheduler *scheduler) {
+  IdleState *idle = &cpu->idle;
+
+  if (cpu->pc != idle->pc) {
+    idle->pc = cpu->pc;
+    idle->rejected = false;
+  } else if (!idle->rejected && cpu->a == idle->a && cpu->x == idle->x && cpu->y == idle->y &&
+             cpu->sp == idle->sp && cpu->status == idle->status) {
+    cpu_skip_idle(cpu);
   }
 
-  /* cpu_trace(instruction, cpu, opcode, trace_pc, addr); */
-
-  switch (opcode) {
-  case 0xFA:
-  case 0xDA: // NOP
-    break;
-  case CASE8_4(0x61):
-    adc(cpu, DATA());
-    operation_cycles = 1;
-    break;
-  case CASE8_4(0x21):
-    cpu->a &= DATA();
-    cpu_set_flag(cpu, FLAG_ZERO, cpu->a == 0x00);
-    cpu_set_flag(cpu, FLAG_NEGATIVE, cpu->a & 0x80);
-    operation_cycles = 1;
-    break;
-  case 0x0A:
-    cpu->a = asl(cpu, cpu->a);
-    break;
-  case CASE4(0x06):
-    bus_write(cpu->bus, addr, asl(cpu, DATA()));
-    break;
-  case VERT_8(0x10):
-    if ((cpu->status >> BRANCH_OFF[opcode >> 6] & 0x01) ==
-        ((opcode >> 5) & 0x01)) {
-      cycles++;
-      addr = cpu->pc + addr;
-      // TODO: sum instead of branch
-      CHECK_PAGE_CROSSING(addr, cpu->pc);
-      cpu->pc = addr;
-    }
-    break;
-  // FIXME: f1 takes too long
-  case CASE8_4(0xE1):
-    adc(cpu, ~DATA());
-    operation_cycles = 1;
-    break;
-  case 0x24:
-  case 0x2c:
-    bit(cpu, DATA());
-    break;
-  case 0x00:
-    brk(cpu);
-    break;
-  /**          flag mask value
-   * CLC 0x18   C   0x01  0
-   * SEC 0x38   C   0x01  1
-   * CLI 0x58   I   0x04  0
-   * SEI 0x78   I   0x04  1
-   * mask = 2 ** (opcode >> 6) * 2
-   * value = bit 5 of opcode
-   */
-  case VERT_4(0x18):
-    cpu_set_flag(cpu, 1 << ((opcode >> 6) << 1), opcode & 0x20);
-    break;
-  case 0xB8:
-    cpu_set_flag(cpu, FLAG_OVERFLOW, false);
-    break;
-  case 0xD8:
-    cpu_set_flag(cpu, FLAG_DECIMAL_MODE, false);
-    break;
-  case 0xF8:
-    cpu_set_flag(cpu, FLAG_DECIMAL_MODE, true);
-    break;
-  case CASE8_4(0xC1): // CMP
-    cmp(cpu, cpu->a, DATA());
-    operation_cycles = 1;
-    break;
-  case 0xE0:
-  case 0xE4:
-  case 0xEC:
-    cmp(cpu, cpu->x, DATA());
-    operation_cycles = 1;
-    break;
-  case 0xC0:
-  case 0xC4:
-  case 0xCC:
-    cmp(cpu, cpu->y, DATA());
-    operation_cycles = 1;
-    break;
-  case CASE4(0xC6): {
-    uint8_t data = bus_read(cpu->bus, addr, false);
-    bus_write(cpu->bus, addr, data - 1);
-    SET_ZERO_NEGATIVE(data - 1);
-    break;
+  idle->a = cpu->a;
+  idle->x = cpu->x;
+  idle->y = cpu->y;
+  idle->sp = cpu->sp;
+  idle->status = cpu->status;
+  idle->clock = scheduler->clock;
+}
+
+/**
+ * Addressing modes, leave the effective address in addr and set crossed
+ * when indexing crossed a page
+ */
+
+#define MODE_IMP
+#define MODE_IMM
+#define MODE_ZP0 addr = operand;
+#define MODE_ZPX addr = (operand + cpu->x) & 0x00FF;
+#define MODE_ZPY addr = (operand + cpu->y) & 0x00FF;
+#define MODE_ABS addr = operand;
+#define MODE_ABX MODE_ABS_INDEXED(cpu->x)
+#define MODE_ABY MODE_ABS_INDEXED(cpu->y)
+#define MODE_ABS_INDEXED(index)                                                \
+  addr = operand + index;                                                      \
+  crossed = (addr & 0xFF00) != (operand & 0xFF00);
+#define MODE_IND                                                               \
+  /* simulate page boundary bug */                                             \
+  if ((operand & 0x00FF) == 0x00FF) {                                          \
+    addr = cpu_read(cpu, operand & 0xFF00) << 8 | cpu_read(cpu, operand);      \
+  } else {                                                                     \
+    addr = cpu_read_wide(cpu, operand);                                        \
   }
-  case 0xCA:
-    cpu->x--;
-    SET_ZERO_NEGATIVE(cpu->x);
-    break;
-  case 0x88:
-    cpu->y--;
-    SET_ZERO_NEGATIVE(cpu->y);
-    break;
-  case CASE8_4(0x41): // EOR
-    eor(cpu, DATA());
-    operation_cycles = 1;
-    break;
-  case CASE4(0xE6): { // INC
-    uint8_t data = bus_read(cpu->bus, addr, false);
-    bus_write(cpu->bus, addr, data + 1);
-    SET_ZERO_NEGATIVE((uint8_t)(data + 1));
-    break;
+#define MODE_IZX                                                               \
+  {                                                                            \
+    uint8_t ptr = operand + cpu->x;                                            \
+    uint16_t lo = zp_read(cpu, ptr);                                           \
+    uint16_t hi = zp_read(cpu, ptr + 1);                                       \
+    addr = (hi << 8) | lo;                                                     \
   }
-  case 0xE8:
-    cpu->x++;
-    SET_ZERO_NEGATIVE(cpu->x);
-    break;
-  case 0xC8:
-    cpu->y++;
-    SET_ZERO_NEGATIVE(cpu->y);
-    break;
-  case 0x4C:
-  case 0x6C:
-    cpu->pc = addr;
-    break;
-  case 0x20: // JSR
-    cpu->pc--;
-    push(cpu, (cpu->pc >> 8) & 0x00FF);
-    push(cpu, cpu->pc & 0x00FF);
-    cpu->pc = addr;
-    break;
-  case CASE8_4(0xA1): // LDA
-    cpu->a = DATA();
-    SET_ZERO_NEGATIVE(cpu->a);
-    operation_cycles = 1;
-    break;
-  case 0xA2:
-  case CASE4(0xA6): // LDX
-    cpu->x = DATA();
-    SET_ZERO_NEGATIVE(cpu->x);
-    operation_cycles = 1;
-    break;
-  case 0xA0:
-  case CASE4(0xA4): // LDY
-    cpu->y = DATA();
-    SET_ZERO_NEGATIVE(cpu->y);
-    operation_cycles = 1;
-    break;
-  case CASE4(0x46):
-    bus_write(cpu->bus, addr, lsr(cpu, DATA()));
-    break;
-  case 0x4A:
-    cpu->a = lsr(cpu, cpu->a);
-    break;
-  case 0xEA:
-    break;
-  case CASE8_4(0x01): // ORA
-    cpu->a |= DATA();
-    SET_ZERO_NEGATIVE(cpu->a);
-    operation_cycles = 1;
-    break;
-  case 0x48:
-    push(cpu, cpu->a);
-    break;
-  case 0x08:
-    push(cpu, cpu->status | FLAG_UNUSED | FLAG_BREAK);
-    break;
-  case 0x68: // PLA
-    cpu->a = bus_read(cpu->bus, 0x0100 + ++cpu->sp, false);
-    SET_ZERO_NEGATIVE(cpu->a);
-    break;
-  case 0x28: // PLP
-    cpu->status = pop(cpu) & ~(FLAG_UNUSED | FLAG_BREAK);
-    break;
-  case CASE4(0x26):
-    bus_write(cpu->bus, addr, rol(cpu, DATA()));
-    break;
-  case 0x2A:
-    cpu->a = rol(cpu, cpu->a);
-    break;
-  case CASE4(0x66):
-    bus_write(cpu->bus, addr, ror(cpu, DATA()));
-    break;
-  case 0x6A:
-    cpu->a = ror(cpu, cpu->a);
-    break;
-  case 0x40:
-    rti(cpu);
-    break;
-  case 0x60:
-    cpu->pc = (pop(cpu) | ((uint16_t)pop(cpu) << 8)) + 1;
-    break;
-  case CASE8_4(0x81):
-    bus_write(cpu->bus, addr, cpu->a);
-    break;
-  case CASE4(0x86):
-    bus_write(cpu->bus, addr, cpu->x);
-    break;
-  case CASE4(0x84):
-    bus_write(cpu->bus, addr, cpu->y);
-    break;
-  case 0xAA:
-    cpu->x = cpu->a;
-    SET_ZERO_NEGATIVE(cpu->x);
-    break;
-  case 0xA8:
-    cpu->y = cpu->a;
-    SET_ZERO_NEGATIVE(cpu->y);
-    break;
-  case 0x8A:
-    cpu->a = cpu->x;
-    SET_ZERO_NEGATIVE(cpu->a);
-    break;
-  case 0x98:
-    cpu->a = cpu->y;
-    SET_ZERO_NEGATIVE(cpu->a);
-    break;
-  case 0xBA:
-    cpu->x = cpu->sp;
-    SET_ZERO_NEGATIVE(cpu->x);
-    break;
-  case 0x9A:
-    cpu->sp = cpu->x;
-    break;
-  default:
-    printf("Unimplemented opcode: %02X\n", opcode);
-    exit(1);
-    break;
+#define MODE_IZY                                                               \
+  {                                                                            \
+    uint16_t lo = zp_read(cpu, operand);                                       \
+    uint16_t hi = zp_read(cpu, operand + 1);                                   \
+    addr = (hi << 8) | lo;                                                     \
+    addr += cpu->y;                                                            \
+    crossed = (addr & 0xFF00) != (hi << 8);                                    \
   }
+#define MODE_REL                                                               \
+  addr = operand;                                                              \
+  if (addr & 0x80) addr |= 0xFF00;
+
+// implied read-modify-write instructions work on the accumulator
+#define READ_IMP cpu->a
+#define READ_IMM operand
+#define READ_ZP0 zp_read(cpu, addr)
+#define READ_ZPX zp_read(cpu, addr)
+#define READ_ZPY zp_read(cpu, addr)
+#define READ_ABS cpu_read(cpu, addr)
+#define READ_ABX cpu_read(cpu, addr)
+#define READ_ABY cpu_read(cpu, addr)
+#define READ_IZX cpu_read(cpu, addr)
+#define READ_IZY cpu_read(cpu, addr)
+#define READ(mode) READ_##mode
+
+#define WRITE_IMP(data) cpu->a = (data)
+#define WRITE_ZP0(data) zp_write(cpu, addr, data)
+#define WRITE_ZPX(data) zp_write(cpu, addr, data)
+#define WRITE_ABS(data) cpu_write(cpu, addr, data)
+#define WRITE_ABX(data) cpu_write(cpu, addr, data)
+#define WRITE(mode, data) WRITE_##mode(data)
+
+// the unofficial stores at 0x89, 0x9C and 0x9E decode as implied, writing to 0
+#define STORE_IMP(data) zp_write(cpu, 0, data)
+#define STORE_ZP0(data) zp_write(cpu, addr, data)
+#define STORE_ZPX(data) zp_write(cpu, addr, data)
+#define STORE_ZPY(data) zp_write(cpu, addr, data)
+#define STORE_ABS(data) cpu_write(cpu, addr, data)
+#define STORE_ABX(data) cpu_write(cpu, addr, data)
+#define STORE_ABY(data) cpu_write(cpu, addr, data)
+#define STORE_IZX(data) cpu_write(cpu, addr, data)
+#define STORE_IZY(data) cpu_write(cpu, addr, data)
+#define STORE(mode, data) STORE_##mode(data)
+
+/**
+ * Operations. Reads that cross a page take one more cycle
+ */
 
-  cpu->cycles = cycles + (addressing_cycles & operation_cycles);
-  return cpu->cycles;
+#define OP_ADC(code, mode) adc(cpu, flags, READ(mode)); cycles += crossed;
+#define OP_SBC(code, mode) adc(cpu, flags, ~READ(mode)); cycles += crossed;
+#define OP_AND(code, mode)                                                     \
+  cpu->a &= READ(mode);                                                        \
+  SET_ZERO_NEGATIVE(cpu->a);                                                   \
+  cycles += crossed;
+#define OP_ORA(code, mode)                                                     \
+  cpu->a |= READ(mode);                                                        \
+  SET_ZERO_NEGATIVE(cpu->a);                                                   \
+  cycles += crossed;
+#define OP_EOR(code, mode) eor(cpu, flags, READ(mode)); cycles += crossed;
+#define OP_CMP(code, mode) cmp(cpu, flags, cpu->a, READ(mode)); cycles += crossed;
+#define OP_CPX(code, mode) cmp(cpu, flags, cpu->x, READ(mode));
+#define OP_CPY(code, mode) cmp(cpu, flags, cpu->y, READ(mode));
+#define OP_BIT(code, mode) bit(cpu, flags, READ(mode));
+
+#define OP_LDA(code, mode) LOAD(cpu->a, mode)
+#define OP_LDX(code, mode) LOAD(cpu->x, mode)
+#define OP_LDY(code, mode) LOAD(cpu->y, mode)
+#define LOAD(reg, mode)                                                        \
+  reg = READ(mode);                                                            \
+  SET_ZERO_NEGATIVE(reg);                                                      \
+  cycles += crossed;
+
+#define OP_STA(code, mode) STORE(mode, cpu->a);
+#define OP_STX(code, mode) STORE(mode, cpu->x);
+#define OP_STY(code, mode) STORE(mode, cpu->y);
+
+#define OP_ASL(code, mode) WRITE(mode, asl(cpu, flags, READ(mode)));
+#define OP_LSR(code, mode) WRITE(mode, lsr(cpu, flags, READ(mode)));
+#define OP_ROL(code, mode) WRITE(mode, rol(cpu, flags, READ(mode)));
+#define OP_ROR(code, mode) WRITE(mode, ror(cpu, flags, READ(mode)));
+#define OP_INC(code, mode) STEP(mode, 1)
+#define OP_DEC(code, mode) STEP(mode, -1)
+#define STEP(mode, delta)                                                      \
+  {                                                                            \
+    uint8_t data = READ(mode) + delta;                                         \
+    WRITE(mode, data);                                                         \
+    SET_ZERO_NEGATIVE(data);                                                   \
+  }
+
+#define OP_INX(code, mode) cpu->x++; SET_ZERO_NEGATIVE(cpu->x);
+#define OP_INY(code, mode) cpu->y++; SET_ZERO_NEGATIVE(cpu->y);
+#define OP_DEX(code, mode) cpu->x--; SET_ZERO_NEGATIVE(cpu->x);
+#define OP_DEY(code, mode) cpu->y--; SET_ZERO_NEGATIVE(cpu->y);
+#define OP_TAX(code, mode) cpu->x = cpu->a; SET_ZERO_NEGATIVE(cpu->x);
+#define OP_TAY(code, mode) cpu->y = cpu->a; SET_ZERO_NEGATIVE(cpu->y);
+#define OP_TXA(code, mode) cpu->a = cpu->x; SET_ZERO_NEGATIVE(cpu->a);
+#define OP_TYA(code, mode) cpu->a = cpu->y; SET_ZERO_NEGATIVE(cpu->a);
+#define OP_TSX(code, mode) cpu->x = cpu->sp; SET_ZERO_NEGATIVE(cpu->x);
+#define OP_TXS(code, mode) cpu->sp = cpu->x;
+
+#define OP_CLC(code, mode) flags->c = 0;
+#define OP_SEC(code, mode) flags->c = 1;
+#define OP_CLI(code, mode)                                                     \
+  cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE, false);                            \
+  cpu_unmask_irq(cpu);
+#define OP_SEI(code, mode) cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE, true);
+#define OP_CLV(code, mode) flags->v = 0;
+#define OP_CLD(code, mode) cpu_set_flag(cpu, FLAG_DECIMAL_MODE, false);
+#define OP_SED(code, mode) cpu_set_flag(cpu, FLAG_DECIMAL_MODE, true);
+
+/**
+ * BPL BMI BVC BVS BCC BCS BNE BEQ test N V C Z (opcode bits 6-7) against
+ * opcode bit 5
+ */
+#define BRANCH_FLAG(code)                                                      \
+  ((code >> 6) == 0   ? (flags->n & FLAG_NEGATIVE) != 0                        \
+   : (code >> 6) == 1 ? (flags->v & FLAG_OVERFLOW) != 0                        \
+   : (code >> 6) == 2 ? flags->c != 0                                          \
+                      : flags->z == 0)
+
+#define OP_BRANCH(code, mode)                                                  \
+  if (BRANCH_FLAG(code) == ((code >> 5) & 0x01)) {                             \
+    cycles++;                                                                  \
+    addr = cpu->pc + addr;                                                     \
+    CHECK_PAGE_CROSSING(addr, cpu->pc);                                        \
+    looped = addr < cpu->pc - 1;                                               \
+    cpu->pc = addr;                                                            \
+  }
+#define OP_BPL OP_BRANCH
+#define OP_BMI OP_BRANCH
+#define OP_BVC OP_BRANCH
+#define OP_BVS OP_BRANCH
+#define OP_BCC OP_BRANCH
+#define OP_BCS OP_BRANCH
+#define OP_BNE OP_BRANCH
+#define OP_BEQ OP_BRANCH
+
+#define OP_JMP(code, mode)                                                     \
+  looped = addr < cpu->pc - 2;                                                 \
+  cpu->pc = addr;
+#define OP_JSR(code, mode)                                                     \
+  cpu->pc--;                                                                   \
+  push(cpu, (cpu->pc >> 8) & 0x00FF);                                          \
+  push(cpu, cpu->pc & 0x00FF);                                                 \
+  cpu->pc = addr;
+#define OP_RTS(code, mode) cpu->pc = (pop(cpu) | ((uint16_t)pop(cpu) << 8)) + 1;
+#define OP_RTI(code, mode) rti(cpu, flags);
+#define OP_BRK(code, mode) brk(cpu, flags);
+
+#define OP_PHA(code, mode) push(cpu, cpu->a);
+#define OP_PHP(code, mode) push(cpu, cpu_status(cpu, flags) | FLAG_UNUSED | FLAG_BREAK);
+#define OP_PLA(code, mode) cpu->a = pop(cpu); SET_ZERO_NEGATIVE(cpu->a);
+#define OP_PLP(code, mode)                                                     \
+  cpu_set_status(cpu, flags, pop(cpu) & ~(FLAG_UNUSED | FLAG_BREAK));          \
+  cpu_unmask_irq(cpu);
+
+#define OP_NOP(code, mode)
+#define OP_ILL(code, mode)                                                     \
+  printf("Unimplemented opcode: %02X\n", code);                                \
+  exit(1);
+
+/**
+ * Dispatch. With computed goto every handler jumps straight to the next one,
+ * otherwise each instruction goes back through a switch. Build with
+ * -DCPU_SWITCH_DISPATCH to force the switch.
+ */
+
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+#define CPU_THREADED
+#endif
+
+#ifdef CPU_THREADED
+#define HANDLER(code) op_##code
+#define DISPATCH()                                                             \
+  decoded = cpu_fetch(cpu);                                                    \
+  operand = decoded.operand;                                                   \
+  goto *handlers[decoded.opcode]
+#else
+#define HANDLER(code) case code
+#define DISPATCH() continue
+#endif
+
+#define X(code, mnemonic, op, mode, base_cycles)                               \
+  HANDLER(code) : {                                                            \
+    uint8_t cycles = base_cycles;                                              \
+    bool crossed = false;                                                      \
+    bool looped = false;                                                       \
+                                                                               \
+    MODE_##mode OP_##op(code, mode)                                            \
+                                                                               \
+    (void)crossed;                                                             \
+    cpu->cycles = cycles;                                                      \
+                                                                               \
+    if (scheduler == NULL) return cpu_stop(cpu, flags, cpu->cycles);           \
+                                                                               \
+    scheduler->clock += cpu->cycles;                                           \
+    if (scheduler->clock >= scheduler->next) return cpu_stop(cpu, flags, 0);   \
+                                                                               \
+    if (looped) {                                                              \
+      cpu->status = cpu_status(cpu, flags);                                    \
+      cpu_jumped_back(cpu, scheduler);                                         \
+      if (scheduler->clock >= scheduler->next) return cpu_stop(cpu, flags, 0); \
+    }                                                                          \
+                                                                               \
+    DISPATCH();                                                                \
+  }
+
+/**
+ * the flags are only packed into status when the cpu stops
+ */
+static inline uint8_t cpu_stop(CPU *cpu, Flags *flags, uint8_t cycles) {
+  cpu->status = cpu_status(cpu, flags);
+  return cycles;
+}
+
+/**
+ * Runs instructions until the scheduler's next deadline, or a single one
+ * when there is no scheduler
+ */
+static inline uint8_t cpu_execute(CPU *cpu, Scheduler *scheduler) {
+#ifdef CPU_THREADED
+#define X_LABEL(code, mnemonic, op, mode, cycles) [code] = &&HANDLER(code),
+  static const void *handlers[256] = {INSTRUCTIONS(X_LABEL)};
+#undef X_LABEL
+#endif
+
+  DecodedInstruction decoded;
+  uint16_t operand;
+  uint16_t addr = 0;
+  Flags lazy;
+  Flags *flags = &lazy;
+
+  if (scheduler && scheduler->clock >= scheduler->next) return 0;
+
+  if (cpu->map_version != cpu->bus->map_version) cpu_revalidate(cpu);
+
+  cpu_set_status(cpu, flags, cpu->status);
+
+#ifdef CPU_THREADED
+  DISPATCH();
+
+  INSTRUCTIONS(X)
+#else
+  for (;;) {
+    decoded = cpu_fetch(cpu);
+    operand = decoded.operand;
+
+    switch (decoded.opcode) { INSTRUCTIONS(X) }
+  }
+#endif
+}
+
+#undef X
+
+uint8_t cpu_step(CPU *cpu) { return cpu_execute(cpu, NULL); }
+
+/**
+ * Lets the jit report loops it runs through the interpreter
+ */
+void cpu_idle(CPU *cpu) { cpu_jumped_back(cpu, cpu->bus->scheduler); }
+
+/**
+ * Runs the cpu up to the next scheduled event, advancing the master clock
+ */
+void cpu_run(CPU *cpu) {
+  if (cpu->jit) {
+    jit_run(cpu);
+    return;
+  }
+
+  cpu_execute(cpu, cpu->bus->scheduler);
 }
 
 void cpu_reset(CPU *cpu) {
@@ -507,26 +804,11 @@ void cpu_reset(CPU *cpu) {
   cpu->cycles = 8;
 }
 
-void cpu_irq(CPU *cpu) {
-  if (!(cpu->status & FLAG_INTERRUPT_DISABLE)) {
-    // save pc
-    push(cpu, (cpu->pc >> 8) & 0x00FF);
-    push(cpu, cpu->pc & 0x00FF);
-
-    cpu_set_flag(cpu, FLAG_BREAK, false);
-    cpu_set_flag(cpu, FLAG_INTERRUPT_DISABLE, true);
-    cpu_set_flag(cpu, FLAG_UNUSED, true);
-
-    // save status
-    push(cpu, cpu->status);
-
-    cpu->pc = bus_read_wide(cpu->bus, 0xFFFE, false);
-
-    cpu->cycles = 7;
-  }
-}
-
-void cpu_nmi(CPU *cpu) {
+/**
+ * Enters the handler at vector. Taking an interrupt costs 7 cycles, which
+ * are spent on the master clock like any instruction's.
+ */
+static void cpu_interrupt(CPU *cpu, uint16_t vector) {
   // save pc
   push(cpu, (cpu->pc >> 8) & 0x00FF);
   push(cpu, cpu->pc & 0x00FF);
@@ -538,7 +820,16 @@ void cpu_nmi(CPU *cpu) {
   // save status
   push(cpu, cpu->status);
 
-  cpu->pc = bus_read_wide(cpu->bus, 0xFFFA, false);
+  cpu->pc = bus_read_wide(cpu->bus, vector, false);
 
-  cpu->cycles = 8;
+  cpu->cycles = 7;
+  if (cpu->bus->scheduler) cpu->bus->scheduler->clock += cpu->cycles;
+}
+
+void cpu_irq(CPU *cpu) {
+  if (!(cpu->status & FLAG_INTERRUPT_DISABLE)) {
+    cpu_interrupt(cpu, 0xFFFE);
+  }
 }
+
+void cpu_nmi(CPU *cpu) { cpu_interrupt(cpu, 0xFFFA); }
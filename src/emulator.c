@@ -6,6 +6,11 @@
 static void load_rom(Emulator *emulator, char *filename) {
   FILE *file = fopen(filename, "rb");
 
+  if (file == NULL) {
+    printf("Could not open %s\n", filename);
+    exit(1);
+  }
+
   // read 16 byte header
   fread(&emulator->header, 1, 16, file);
 
@@ -35,60 +40,75 @@ void emulator_init(Emulator *emulator, char *filename) {
 
   uint8_t mirror_mode = emulator->header[6] & 0x01;
 
+  // carts with their own extra vram ignore the mirroring bit
+  if (emulator->header[6] & 0x08) {
+    mirror_mode = MIRRORING_FOUR_SCREEN;
+  }
+
+  scheduler_init(&emulator->scheduler);
   mapper_init(&emulator->mapper, mapper_id, mirror_mode);
   bus_init(&emulator->bus, &emulator->mapper, &emulator->ppu, &emulator->apu,
-           emulator->controller);
+           &emulator->scheduler, emulator->controller);
   cpu_init(&emulator->cpu, &emulator->bus);
-  apu_init(&emulator->apu, &emulator->mapper);
-  ppu_init(&emulator->ppu, &emulator->mapper, mirror_mode);
+  apu_init(&emulator->apu, &emulator->mapper, &emulator->scheduler);
+  ppu_init(&emulator->ppu, &emulator->mapper, &emulator->scheduler, mirror_mode);
 }
 
-void emulator_step(Emulator *emulator) {
-  while (emulator->ppu.frame_complete == false) {
-    int cycles = 0;
+static void handle_event(Emulator *emulator, EventType type) {
+  Scheduler *scheduler = &emulator->scheduler;
 
-    if (emulator->bus.dma_transfer) {
-      bus_dma_transfer(&emulator->bus, emulator->cycles);
-    } else {
-      cycles = cpu_step(&emulator->cpu);
-    }
-
-    for (int i = 0; i < cycles; i++) {
-      apu_step(&emulator->apu);
-    }
+  switch (type) {
+  case EVENT_PPU: ppu_run(&emulator->ppu, scheduler->clock * 3); break;
+  case EVENT_APU_FRAME:
+  case EVENT_DMC: apu_run(&emulator->apu, scheduler->clock); break;
+  case EVENT_DMA: emulator->bus.dma_transfer = false; break;
+  default: break;
+  }
+}
 
-    /* APU Interrupts */
-    /* disabled for now
-      if (emulator->apu.dmc.stall) {
-        cycles += 4;
-      }
+static void poll_interrupts(Emulator *emulator) {
+  if (emulator->ppu.nmi) {
+    emulator->ppu.nmi = false;
+    cpu_nmi(&emulator->cpu);
+  }
 
-      if (emulator->apu.dmc.irq_active) {
-        cpu_irq(&emulator->cpu);
-      }
+  // the irq line stays asserted until the game acknowledges its source, the
+  // cpu also stops when it clears I so a pending irq is taken right away
+  if (bus_irq_line(&emulator->bus)) {
+    cpu_irq(&emulator->cpu);
+  }
+}
 
-      if (emulator->apu.frame_irq_active) {
-        emulator->apu.frame_irq_active = false;
-        cpu_irq(&emulator->cpu);
-      }
-    */
+/**
+ * Runs the cpu freely up to the next scheduled event, then lets the other
+ * components catch up. DMC fetch stalls are not emulated.
+ */
+void emulator_step(Emulator *emulator) {
+  Scheduler *scheduler = &emulator->scheduler;
+  EventType type;
 
-    for (int i = 0; i < cycles * 3; i++) {
-      ppu_step(&emulator->ppu);
+  while (emulator->ppu.frame_complete == false) {
+    if (emulator->bus.dma_request) {
+      bus_dma_transfer(&emulator->bus);
     }
 
-    if (emulator->ppu.nmi) {
-      emulator->ppu.nmi = false;
-      cpu_nmi(&emulator->cpu);
+    if (emulator->bus.dma_transfer) {
+      // the cpu is halted until the transfer is done
+      if (scheduler->clock < scheduler->next) scheduler->clock = scheduler->next;
+    } else {
+      cpu_run(&emulator->cpu);
     }
 
-    if (emulator->mapper.irq_active) {
-      emulator->mapper.irq_active = false;
-      cpu_irq(&emulator->cpu);
+    while (scheduler_pop(scheduler, &type)) {
+      handle_event(emulator, type);
     }
 
-    emulator->cycles++;
+    if (!emulator->bus.dma_transfer) {
+      poll_interrupts(emulator);
+    }
   }
 
+  apu_run(&emulator->apu, scheduler->clock);
+  apu_end_frame(&emulator->apu);
   emulator->ppu.frame_complete = false;
 }
@@ -2,6 +2,7 @@
 #include "ppu.h"
 
 #include <SDL2/SDL.h>
+#include <string.h>
 
 void frontend_draw_tiles(Frontend *frontend, uint8_t *mem);
 void frontend_draw_sprites(Frontend *frontend, uint8_t *mem);
@@ -10,15 +11,45 @@ void frontend_draw_sprites(Frontend *frontend, uint8_t *mem);
 #define WIDTH 256
 #define HEIGHT 240
 
+#define FRAME_RATE 60.0988
+#define MAX_FRAME_SKIP 4
+
+/** how far audio and video may stray from the nes clock to stay in sync */
+#define MAX_RATE_DELTA 0.005
+
+static void frontend_queue_audio(void *userdata, const float *samples, uint32_t count) {
+  Frontend *frontend = userdata;
+  audio_ring_write(&frontend->audio, samples, count);
+}
+
+/**
+ * Runs on the audio thread. Missing samples repeat the last frame, as the
+ * output sits well above 0 and dropping to silence would click.
+ */
+static void frontend_audio_callback(void *userdata, uint8_t *stream, int len) {
+  Frontend *frontend = userdata;
+  float *samples = (float *)stream;
+  uint32_t count = len / sizeof(float);
+  uint32_t read = audio_ring_read(&frontend->audio, samples, count);
+
+  if (read >= CHANNELS) {
+    memcpy(frontend->audio_last, samples + read - CHANNELS, sizeof(frontend->audio_last));
+  }
+
+  for (uint32_t i = read; i < count; i++) {
+    samples[i] = frontend->audio_last[i % CHANNELS];
+  }
+}
+
 void frontend_init(Frontend *frontend) {
-  if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+  if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0) {
     SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
     SDL_Quit();
   }
 
-  SDL_Window *window = SDL_CreateWindow(
-      "leekboy", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-      256 * SCALE + 128 * SCALE, (128 + 128) * SCALE, SDL_WINDOW_SHOWN);
+  SDL_Window *window =
+      SDL_CreateWindow("leekboy", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                       WIDTH * SCALE, HEIGHT * SCALE, SDL_WINDOW_SHOWN);
 
   if (window == NULL) {
     printf("Window creation failed: %s\n", SDL_GetError());
@@ -35,12 +66,69 @@ void frontend_init(Frontend *frontend) {
                                                    SDL_TEXTUREACCESS_STREAMING, 128, 128);
   SDL_Texture *pattern_table_2 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
                                                    SDL_TEXTUREACCESS_STREAMING, 128, 128);
+  SDL_Texture *nametables = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32,
+                                              SDL_TEXTUREACCESS_STREAMING, 512, 480);
+
+  audio_ring_init(&frontend->audio);
+  memset(frontend->audio_last, 0, sizeof(frontend->audio_last));
+
+  SDL_AudioSpec audio_spec;
+  audio_spec.freq = SAMPLE_RATE;
+  audio_spec.format = AUDIO_F32SYS;
+  audio_spec.channels = CHANNELS;
+  audio_spec.samples = SAMPLES;
+  audio_spec.callback = frontend_audio_callback;
+  audio_spec.userdata = frontend;
 
+  // the format is converted by sdl if the device wants another one
+  SDL_AudioSpec obtained_spec;
+  frontend->audio_device = SDL_OpenAudioDevice(NULL, 0, &audio_spec, &obtained_spec, 0);
+  if (frontend->audio_device == 0) {
+    SDL_Log("Unable to open audio: %s", SDL_GetError());
+  }
+  SDL_PauseAudioDevice(frontend->audio_device, 0);
+
+  frontend->window = window;
   frontend->renderer = renderer;
   frontend->texture = texture;
 
+  frontend->debug = false;
   frontend->pattern_table_textures[0] = pattern_table_1;
   frontend->pattern_table_textures[1] = pattern_table_2;
+  frontend->nametable_texture = nametables;
+
+  frontend->frame_due = 0;
+  frontend->frames_skipped = 0;
+}
+
+/**
+ * The debug panel shows the pattern tables and the nametables to the right of
+ * the game. The ppu only keeps them while the panel is open.
+ */
+static void frontend_toggle_debug(Frontend *frontend, Emulator *emulator) {
+  frontend->debug = !frontend->debug;
+
+  if (frontend->debug) {
+    // the panel stays closed when the ppu can't keep the tables
+    if (!ppu_debug_open(&emulator->ppu)) {
+      frontend->debug = false;
+      return;
+    }
+
+    SDL_SetWindowSize(frontend->window, WIDTH * SCALE + 128 * SCALE + 512, 128 * 2 * SCALE);
+  } else {
+    ppu_debug_close(&emulator->ppu);
+    SDL_SetWindowSize(frontend->window, WIDTH * SCALE, HEIGHT * SCALE);
+  }
+}
+
+static void frontend_quit(Frontend *frontend) {
+  SDL_CloseAudioDevice(frontend->audio_device);
+  printf("audio: %u samples dropped, %u samples missing\n", frontend->audio.overruns,
+         frontend->audio.underruns);
+
+  SDL_Quit();
+  exit(0);
 }
 
 void frontend_update(Frontend *frontend, Emulator *emulator) {
@@ -48,13 +136,14 @@ void frontend_update(Frontend *frontend, Emulator *emulator) {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     if (event.type == SDL_QUIT) {
-      SDL_Quit();
-      exit(0);
+      frontend_quit(frontend);
     } else if (event.type == SDL_KEYDOWN) {
       switch (event.key.keysym.sym) {
       case SDLK_ESCAPE:
-        SDL_Quit();
-        exit(0);
+        frontend_quit(frontend);
+      case SDLK_TAB:
+        frontend_toggle_debug(frontend, emulator);
+        break;
       }
     }
   }
@@ -70,8 +159,9 @@ void frontend_update(Frontend *frontend, Emulator *emulator) {
   emulator->controller[0] |= keyboard_state[SDL_SCANCODE_DOWN] << 2;
   emulator->controller[0] |= keyboard_state[SDL_SCANCODE_LEFT] << 1;
   emulator->controller[0] |= keyboard_state[SDL_SCANCODE_RIGHT] << 0;
+}
 
-  // draw
+static void frontend_draw(Frontend *frontend, Emulator *emulator) {
   SDL_SetRenderDrawColor(frontend->renderer, 0, 0, 0, 255);
   SDL_RenderClear(frontend->renderer);
 
@@ -82,41 +172,134 @@ void frontend_update(Frontend *frontend, Emulator *emulator) {
   rect.w = WIDTH * 2;
   rect.h = HEIGHT * 2;
 
-  SDL_UpdateTexture(frontend->texture, NULL, emulator->ppu.framebuffer,
-                    WIDTH * sizeof(uint32_t));
+  void *pixels;
+  int pitch;
+
+  SDL_LockTexture(frontend->texture, NULL, &pixels, &pitch);
+  ppu_convert_frame(&emulator->ppu, PIXEL_FORMAT_RGBA32, pixels, pitch);
+  SDL_UnlockTexture(frontend->texture);
   SDL_RenderCopy(frontend->renderer, frontend->texture, NULL, &rect);
 
   // Debug
-  SDL_Rect pattern_table_1;
-  pattern_table_1.x = rect.w;
-  pattern_table_1.y = 0;
-  pattern_table_1.w = 128 * 2;
-  pattern_table_1.h = 128 * 2;
-
-  SDL_Rect pattern_table_2;
-  pattern_table_2.x = rect.w;
-  pattern_table_2.y = pattern_table_1.h;
-  pattern_table_2.w = 128 * 2;
-  pattern_table_2.h = 128 * 2;
-
-  SDL_UpdateTexture(frontend->pattern_table_textures[0], NULL,
-                    ppu_get_pattern_table(&emulator->ppu, 0, 0),
-                    128 * sizeof(uint32_t));
-  SDL_RenderCopy(frontend->renderer, frontend->pattern_table_textures[0], NULL,
-                 &pattern_table_1);
-
-  SDL_UpdateTexture(frontend->pattern_table_textures[1], NULL,
-                    ppu_get_pattern_table(&emulator->ppu, 1, 0),
-                    128 * sizeof(uint32_t));
-  SDL_RenderCopy(frontend->renderer, frontend->pattern_table_textures[1], NULL,
-                 &pattern_table_2);
+  if (frontend->debug) {
+    ppu_debug_update(&emulator->ppu, 0);
+
+    SDL_Rect pattern_table_1;
+    pattern_table_1.x = rect.w;
+    pattern_table_1.y = 0;
+    pattern_table_1.w = 128 * 2;
+    pattern_table_1.h = 128 * 2;
+
+    SDL_Rect pattern_table_2;
+    pattern_table_2.x = rect.w;
+    pattern_table_2.y = pattern_table_1.h;
+    pattern_table_2.w = 128 * 2;
+    pattern_table_2.h = 128 * 2;
+
+    SDL_Rect nametables;
+    nametables.x = rect.w + pattern_table_1.w;
+    nametables.y = 0;
+    nametables.w = 512;
+    nametables.h = 480;
+
+    SDL_UpdateTexture(frontend->pattern_table_textures[0], NULL,
+                      emulator->ppu.debug->pattern_tables[0], 128 * sizeof(uint32_t));
+    SDL_RenderCopy(frontend->renderer, frontend->pattern_table_textures[0], NULL,
+                   &pattern_table_1);
+
+    SDL_UpdateTexture(frontend->pattern_table_textures[1], NULL,
+                      emulator->ppu.debug->pattern_tables[1], 128 * sizeof(uint32_t));
+    SDL_RenderCopy(frontend->renderer, frontend->pattern_table_textures[1], NULL,
+                   &pattern_table_2);
+
+    SDL_UpdateTexture(frontend->nametable_texture, NULL, emulator->ppu.debug->nametables,
+                      512 * sizeof(uint32_t));
+    SDL_RenderCopy(frontend->renderer, frontend->nametable_texture, NULL, &nametables);
+  }
 
   SDL_RenderPresent(frontend->renderer);
 }
 
+static double frontend_now(void) {
+  return (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+}
+
+/**
+ * Frames are left undrawn while the emulation runs more than a frame behind
+ * the wall clock, up to MAX_FRAME_SKIP in a row so the picture keeps moving.
+ * A host that falls too far behind is let off the debt instead of skipping
+ * forever.
+ */
+static bool frontend_skip_frame(Frontend *frontend) {
+  double now = frontend_now();
+  double behind = (now - frontend->frame_due) * FRAME_RATE;
+
+  if (behind > MAX_FRAME_SKIP * 2) {
+    frontend->frame_due = now;
+  }
+
+  frontend->frame_due += 1 / FRAME_RATE;
+
+  if (behind > 1 && frontend->frames_skipped < MAX_FRAME_SKIP) {
+    frontend->frames_skipped++;
+    return true;
+  }
+
+  frontend->frames_skipped = 0;
+  return false;
+}
+
+/**
+ * Dynamic rate control: the apu makes slightly more samples while the ring is
+ * less than half full and slightly fewer while it is fuller, so the audio
+ * device neither runs dry nor overflows when vsync sets the pace.
+ */
+static void frontend_adjust_audio(Frontend *frontend, Emulator *emulator) {
+  double fill = (double)audio_ring_count(&frontend->audio) / AUDIO_RING_SIZE;
+  apu_set_sample_rate(&emulator->apu, SAMPLE_RATE * (1 + MAX_RATE_DELTA * (1 - 2 * fill)));
+}
+
+/**
+ * A display a little off 60.0988Hz makes every present return a bit late or
+ * early. That much is forgiven each frame so it does not add up to a skipped
+ * frame, and the audio rate control absorbs the difference.
+ */
+static void frontend_follow_vsync(Frontend *frontend) {
+  double late = frontend_now() - frontend->frame_due;
+  double drift = MAX_RATE_DELTA / FRAME_RATE;
+
+  if (late > 0) {
+    frontend->frame_due += late < drift ? late : drift;
+  }
+}
+
 void frontend_run(Frontend *frontend, Emulator *emulator) {
+  emulator->apu.sink.write = frontend_queue_audio;
+  emulator->apu.sink.userdata = frontend;
+
+  // pixels are composed on another core when there is one to spare
+  if (SDL_GetCPUCount() > 1) {
+    ppu_worker_start(&emulator->ppu);
+  }
+
+  frontend->frame_due = frontend_now();
+
   while (1) {
     frontend_update(frontend, emulator);
+
+    // the core never waits for the audio device, it is held to the wall clock here
+    double ahead = frontend->frame_due - frontend_now();
+    if (ahead > 0) {
+      SDL_Delay(ahead * 1000);
+    }
+
+    emulator->ppu.skip_render = frontend_skip_frame(frontend);
     emulator_step(emulator);
+    frontend_adjust_audio(frontend, emulator);
+
+    if (!emulator->ppu.skip_render) {
+      frontend_draw(frontend, emulator);
+      frontend_follow_vsync(frontend);
+    }
   }
 }
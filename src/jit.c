@@ -0,0 +1,839 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "instructions.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Compiles hot straight-line runs of prg rom code into x86-64.
+ *
+ * Blocks never cross a 256 byte page and end at the first branch, jump,
+ * JSR or RTS, or right before an instruction the compiler does not handle.
+ * Every memory access goes through the bus page table, a NULL page (i/o,
+ * mapper registers, open bus) leaves the block right before the access so
+ * the interpreter runs that instruction with the usual catch up. Only rom
+ * is compiled, so code written to ram keeps running interpreted.
+ *
+ * While in a block the 6502 registers stay in the CPU struct:
+ *   rbx  CPU *
+ *   r12  cycles not known at compile time (page crossings, loop passes)
+ *   r13  &bus->read_pages
+ *   r14  &bus->write_pages
+ *   r15  cycle budget
+ */
+
+#ifdef __x86_64__
+
+#include <sys/mman.h>
+
+typedef enum {
+  JIT_ADC, JIT_AND, JIT_ASL, JIT_BCC, JIT_BCS, JIT_BEQ, JIT_BIT, JIT_BMI, JIT_BNE, JIT_BPL,
+  JIT_BRK, JIT_BVC, JIT_BVS, JIT_CLC, JIT_CLD, JIT_CLI, JIT_CLV, JIT_CMP, JIT_CPX, JIT_CPY,
+  JIT_DEC, JIT_DEX, JIT_DEY, JIT_EOR, JIT_ILL, JIT_INC, JIT_INX, JIT_INY, JIT_JMP, JIT_JSR,
+  JIT_LDA, JIT_LDX, JIT_LDY, JIT_LSR, JIT_NOP, JIT_ORA, JIT_PHA, JIT_PHP, JIT_PLA, JIT_PLP,
+  JIT_ROL, JIT_ROR, JIT_RTI, JIT_RTS, JIT_SBC, JIT_SEC, JIT_SED, JIT_SEI, JIT_STA, JIT_STX,
+  JIT_STY, JIT_TAX, JIT_TAY, JIT_TSX, JIT_TXA, JIT_TXS, JIT_TYA
+} JitOperation;
+
+#define X(code, mnemonic, op, mode, cycles) [code] = JIT_##op,
+static const uint8_t operations[256] = {INSTRUCTIONS(X)};
+#undef X
+
+static const uint8_t operand_length[] = {
+    [ADDR_MODE_IMP] = 0, [ADDR_MODE_IMM] = 1, [ADDR_MODE_ZP0] = 1, [ADDR_MODE_ZPX] = 1,
+    [ADDR_MODE_ZPY] = 1, [ADDR_MODE_REL] = 1, [ADDR_MODE_ABS] = 2, [ADDR_MODE_ABX] = 2,
+    [ADDR_MODE_ABY] = 2, [ADDR_MODE_IND] = 2, [ADDR_MODE_IZX] = 1, [ADDR_MODE_IZY] = 1,
+};
+
+// x86 register numbers
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+#define OFFSET_A offsetof(CPU, a)
+#define OFFSET_X offsetof(CPU, x)
+#define OFFSET_Y offsetof(CPU, y)
+#define OFFSET_SP offsetof(CPU, sp)
+#define OFFSET_PC offsetof(CPU, pc)
+#define OFFSET_STATUS offsetof(CPU, status)
+
+#define MAX_EXITS (JIT_BLOCK_LENGTH * 4 + 4)
+
+typedef struct {
+  uint8_t *rel32;
+  uint16_t pc;
+  uint32_t cycles;
+  /** RTS has already stored the pc and cycles, only the epilogue is left */
+  bool dynamic_pc;
+} JitExit;
+
+typedef struct {
+  uint8_t *code;
+  uint8_t *end;
+  bool overflow;
+
+  /** jumps still to be pointed at their exit stub */
+  JitExit exits[MAX_EXITS];
+  int exit_count;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t byte) {
+  if (e->code >= e->end) {
+    e->overflow = true;
+    return;
+  }
+
+  *e->code++ = byte;
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit8(e, value >> (i * 8));
+  }
+}
+
+static void emit_bytes(Emitter *e, const uint8_t *bytes, int length) {
+  for (int i = 0; i < length; i++) {
+    emit8(e, bytes[i]);
+  }
+}
+
+#define EMIT(...) emit_bytes(e, (const uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+
+static void patch32(uint8_t *at, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    at[i] = value >> (i * 8);
+  }
+}
+
+/** a [rbx + field] operand, with reg in the modrm reg slot */
+static void emit_field(Emitter *e, uint8_t reg, size_t offset) {
+  emit8(e, 0x83 | (reg << 3));
+  emit32(e, offset);
+}
+
+/** movzx reg, byte [rbx + field] */
+static void load_field(Emitter *e, uint8_t reg, size_t offset) {
+  EMIT(0x0F, 0xB6);
+  emit_field(e, reg, offset);
+}
+
+/** mov byte [rbx + field], reg8 */
+static void store_field(Emitter *e, uint8_t reg, size_t offset) {
+  EMIT(0x88);
+  emit_field(e, reg, offset);
+}
+
+/** jcc rel32 to an exit that leaves the block at pc, having taken cycles */
+static void emit_exit_jump(Emitter *e, uint8_t jcc, uint16_t pc, uint32_t cycles) {
+  if (jcc) {
+    EMIT(0x0F, jcc);
+  } else {
+    EMIT(0xE9);
+  }
+
+  if (e->exit_count == MAX_EXITS || e->overflow) {
+    e->overflow = true;
+    return;
+  }
+
+  e->exits[e->exit_count++] = (JitExit){e->code, pc, cycles, false};
+  emit32(e, 0);
+}
+
+#define JZ 0x84
+#define JA 0x87
+#define JMP 0
+
+/**
+ * Reads the byte at the address in ecx into eax, leaving the block when
+ * the page is not plain memory. Clobbers edx and esi.
+ */
+static void emit_read(Emitter *e, uint16_t pc, uint32_t cycles) {
+  EMIT(0x89, 0xCA);                   // mov edx, ecx
+  EMIT(0xC1, 0xEA, 0x08);             // shr edx, 8
+  EMIT(0x49, 0x8B, 0x54, 0xD5, 0x00); // mov rdx, [r13 + rdx * 8]
+  EMIT(0x48, 0x85, 0xD2);             // test rdx, rdx
+  emit_exit_jump(e, JZ, pc, cycles);
+  EMIT(0x0F, 0xB6, 0xF1);             // movzx esi, cl
+  EMIT(0x0F, 0xB6, 0x04, 0x32);       // movzx eax, byte [rdx + rsi]
+}
+
+/**
+ * Points rdx + rsi at the writable byte for the address in ecx, leaving
+ * the block when there is none.
+ */
+static void emit_write_lookup(Emitter *e, uint16_t pc, uint32_t cycles) {
+  EMIT(0x89, 0xCA);                   // mov edx, ecx
+  EMIT(0xC1, 0xEA, 0x08);             // shr edx, 8
+  EMIT(0x49, 0x8B, 0x54, 0xD6, 0x00); // mov rdx, [r14 + rdx * 8]
+  EMIT(0x48, 0x85, 0xD2);             // test rdx, rdx
+  emit_exit_jump(e, JZ, pc, cycles);
+  EMIT(0x0F, 0xB6, 0xF1);             // movzx esi, cl
+}
+
+static void emit_store_lookup(Emitter *e) {
+  EMIT(0x88, 0x04, 0x32); // mov [rdx + rsi], al
+}
+
+/** the stack page is always ram, so it is accessed without a check */
+static void emit_push(Emitter *e, int depth) {
+  load_field(e, ECX, OFFSET_SP);
+  if (depth) EMIT(0x83, 0xE9, depth, 0x0F, 0xB6, 0xC9); // sub ecx, depth; movzx ecx, cl
+  EMIT(0x49, 0x8B, 0x56, 0x08);                         // mov rdx, [r14 + 8]
+  EMIT(0x88, 0x04, 0x0A);                               // mov [rdx + rcx], al
+}
+
+static void emit_pop(Emitter *e, int depth) {
+  load_field(e, ECX, OFFSET_SP);
+  EMIT(0x83, 0xC1, depth, 0x0F, 0xB6, 0xC9); // add ecx, depth; movzx ecx, cl
+  EMIT(0x49, 0x8B, 0x55, 0x08);              // mov rdx, [r13 + 8]
+  EMIT(0x0F, 0xB6, 0x04, 0x0A);              // movzx eax, byte [rdx + rcx]
+}
+
+/**
+ * Moves the x86 carry, zero, sign and overflow flags into the status
+ * register bits selected by mask.
+ */
+static void emit_flags(Emitter *e, uint8_t mask) {
+  EMIT(0x9C, 0x5A);                         // pushfq; pop rdx
+  EMIT(0x89, 0xD1);                         // mov ecx, edx
+  EMIT(0x81, 0xE1, 0x81, 0x00, 0x00, 0x00); // and ecx, 0x81 (C, N)
+  EMIT(0xC1, 0xEA, 0x05);                   // shr edx, 5
+  EMIT(0x81, 0xE2, 0x42, 0x00, 0x00, 0x00); // and edx, 0x42 (Z, V)
+  EMIT(0x09, 0xD1);                         // or ecx, edx
+  EMIT(0x81, 0xE1, mask, 0x00, 0x00, 0x00); // and ecx, mask
+  load_field(e, EDX, OFFSET_STATUS);
+  EMIT(0x81, 0xE2, (uint8_t)~mask, 0x00, 0x00, 0x00); // and edx, ~mask
+  EMIT(0x09, 0xCA);                                   // or edx, ecx
+  store_field(e, EDX, OFFSET_STATUS);
+}
+
+#define FLAGS_NZ (FLAG_NEGATIVE | FLAG_ZERO)
+#define FLAGS_NZC (FLAG_NEGATIVE | FLAG_ZERO | FLAG_CARRY)
+#define FLAGS_NVZC (FLAG_NEGATIVE | FLAG_OVERFLOW | FLAG_ZERO | FLAG_CARRY)
+
+/** sets N and Z from al and C from the bit saved in edi */
+static void emit_flags_rotate(Emitter *e) {
+  EMIT(0x84, 0xC0); // test al, al
+  emit_flags(e, FLAGS_NZ);
+  EMIT(0x80, 0xA3); // and byte [rbx + status], ~C
+  emit32(e, OFFSET_STATUS);
+  emit8(e, (uint8_t)~FLAG_CARRY);
+  EMIT(0x40, 0x08, 0xBB); // or byte [rbx + status], dil
+  emit32(e, OFFSET_STATUS);
+}
+
+/** and/or byte [rbx + status], imm8 */
+static void emit_status(Emitter *e, bool set, uint8_t flag) {
+  EMIT(0x80, set ? 0x8B : 0xA3);
+  emit32(e, OFFSET_STATUS);
+  emit8(e, set ? flag : (uint8_t)~flag);
+}
+
+/** edi = 1 when the effective address in ecx left the page of base (in edx) */
+static void emit_page_crossing(Emitter *e) {
+  EMIT(0x89, 0xCE);       // mov esi, ecx
+  EMIT(0xC1, 0xEE, 0x08); // shr esi, 8
+  EMIT(0xC1, 0xEA, 0x08); // shr edx, 8
+  EMIT(0x39, 0xF2);       // cmp edx, esi
+  EMIT(0x0F, 0x95, 0xC2); // setne dl
+  EMIT(0x0F, 0xB6, 0xFA); // movzx edi, dl
+}
+
+/**
+ * Leaves the effective address of the instruction in ecx. For indexed
+ * modes edi tells whether a page was crossed.
+ */
+static void emit_address(Emitter *e, AddressingMode mode, uint16_t operand, uint16_t pc,
+                         uint32_t cycles) {
+  switch (mode) {
+  case ADDR_MODE_ZP0:
+  case ADDR_MODE_ABS:
+    EMIT(0xB9); // mov ecx, operand
+    emit32(e, operand);
+    break;
+  case ADDR_MODE_ZPX:
+  case ADDR_MODE_ZPY:
+    load_field(e, ECX, mode == ADDR_MODE_ZPX ? OFFSET_X : OFFSET_Y);
+    EMIT(0x81, 0xC1); // add ecx, operand
+    emit32(e, operand);
+    EMIT(0x0F, 0xB6, 0xC9); // movzx ecx, cl
+    break;
+  case ADDR_MODE_ABX:
+  case ADDR_MODE_ABY:
+    load_field(e, ECX, mode == ADDR_MODE_ABX ? OFFSET_X : OFFSET_Y);
+    EMIT(0x81, 0xC1); // add ecx, operand
+    emit32(e, operand);
+    EMIT(0xBA); // mov edx, operand
+    emit32(e, operand);
+    emit_page_crossing(e);
+    EMIT(0x0F, 0xB7, 0xC9); // movzx ecx, cx
+    break;
+  case ADDR_MODE_IZX:
+    load_field(e, ECX, OFFSET_X);
+    EMIT(0x81, 0xC1); // add ecx, operand
+    emit32(e, operand);
+    EMIT(0x0F, 0xB6, 0xC9); // movzx ecx, cl
+    emit_read(e, pc, cycles);
+    EMIT(0x89, 0xC7);       // mov edi, eax
+    EMIT(0xFF, 0xC1);       // inc ecx
+    EMIT(0x0F, 0xB6, 0xC9); // movzx ecx, cl
+    emit_read(e, pc, cycles);
+    EMIT(0xC1, 0xE0, 0x08); // shl eax, 8
+    EMIT(0x09, 0xF8);       // or eax, edi
+    EMIT(0x89, 0xC1);       // mov ecx, eax
+    break;
+  case ADDR_MODE_IZY:
+    EMIT(0xB9); // mov ecx, operand
+    emit32(e, operand);
+    emit_read(e, pc, cycles);
+    EMIT(0x89, 0xC7); // mov edi, eax
+    EMIT(0xB9);       // mov ecx, operand + 1
+    emit32(e, (operand + 1) & 0xFF);
+    emit_read(e, pc, cycles);
+    EMIT(0xC1, 0xE0, 0x08); // shl eax, 8
+    EMIT(0x09, 0xF8);       // or eax, edi
+    load_field(e, ECX, OFFSET_Y);
+    EMIT(0x01, 0xC1); // add ecx, eax
+    EMIT(0x89, 0xC2); // mov edx, eax
+    emit_page_crossing(e);
+    EMIT(0x0F, 0xB7, 0xC9); // movzx ecx, cx
+    break;
+  default:
+    break;
+  }
+}
+
+/** eax = the operand of a read instruction, paying for page crossings */
+static void emit_operand(Emitter *e, AddressingMode mode, uint16_t operand, uint16_t pc,
+                         uint32_t cycles) {
+  if (mode == ADDR_MODE_IMM) {
+    EMIT(0xB8); // mov eax, operand
+    emit32(e, operand);
+    return;
+  }
+
+  emit_address(e, mode, operand, pc, cycles);
+  emit_read(e, pc, cycles);
+
+  if (mode == ADDR_MODE_ABX || mode == ADDR_MODE_ABY || mode == ADDR_MODE_IZY) {
+    EMIT(0x41, 0x01, 0xFC); // add r12d, edi
+  }
+}
+
+/** writes al to the effective address */
+static void emit_store(Emitter *e, AddressingMode mode, uint16_t operand, uint16_t pc,
+                       uint32_t cycles, size_t reg) {
+  emit_address(e, mode, operand, pc, cycles);
+  emit_write_lookup(e, pc, cycles);
+  load_field(e, EAX, reg);
+  emit_store_lookup(e);
+}
+
+/** applies a read-modify-write operation (on al) to A or memory */
+static void emit_modify(Emitter *e, AddressingMode mode, uint16_t operand, uint16_t pc,
+                        uint32_t cycles, JitOperation op) {
+  bool accumulator = mode == ADDR_MODE_IMP;
+
+  if (accumulator) {
+    load_field(e, EAX, OFFSET_A);
+  } else {
+    emit_address(e, mode, operand, pc, cycles);
+    emit_read(e, pc, cycles);
+    emit_write_lookup(e, pc, cycles);
+  }
+
+  if (op == JIT_ROL || op == JIT_ROR) {
+    load_field(e, ECX, OFFSET_STATUS);
+    EMIT(0x0F, 0xBA, 0xE1, 0x00);              // bt ecx, 0
+    EMIT(0xD0, op == JIT_ROL ? 0xD0 : 0xD8);   // rcl/rcr al, 1
+    EMIT(0x0F, 0x92, 0xC1, 0x0F, 0xB6, 0xF9);  // setc cl; movzx edi, cl
+  } else {
+    switch (op) {
+    case JIT_ASL: EMIT(0xD0, 0xE0); break; // shl al, 1
+    case JIT_LSR: EMIT(0xD0, 0xE8); break; // shr al, 1
+    case JIT_INC: EMIT(0xFE, 0xC0); break; // inc al
+    default: EMIT(0xFE, 0xC8); break;      // dec al
+    }
+  }
+
+  if (accumulator) {
+    store_field(e, EAX, OFFSET_A);
+  } else {
+    emit_store_lookup(e);
+  }
+
+  if (op == JIT_ROL || op == JIT_ROR) {
+    emit_flags_rotate(e);
+  } else {
+    emit_flags(e, op == JIT_INC || op == JIT_DEC ? FLAGS_NZ : FLAGS_NZC);
+  }
+}
+
+/** copies one register into another, setting N and Z unless it is TXS */
+static void emit_transfer(Emitter *e, size_t from, size_t to, bool flags) {
+  load_field(e, EAX, from);
+  store_field(e, EAX, to);
+
+  if (flags) {
+    EMIT(0x84, 0xC0); // test al, al
+    emit_flags(e, FLAGS_NZ);
+  }
+}
+
+/** inc/dec byte [rbx + reg] */
+static void emit_step(Emitter *e, size_t reg, bool increment) {
+  load_field(e, EAX, reg);
+  EMIT(0xFE, increment ? 0xC0 : 0xC8);
+  store_field(e, EAX, reg);
+  emit_flags(e, FLAGS_NZ);
+}
+
+/**
+ * Compiles the instruction at pc, cycles being the static cycles taken by
+ * the block before it. Returns false when it is left to the interpreter.
+ */
+static bool compile_instruction(Emitter *e, uint8_t opcode, uint16_t operand, uint16_t pc,
+                                uint32_t cycles) {
+  JitOperation op = operations[opcode];
+  AddressingMode mode = instructions[opcode].addressing_mode;
+
+  switch (op) {
+  case JIT_LDA:
+  case JIT_LDX:
+  case JIT_LDY: {
+    size_t reg = op == JIT_LDA ? OFFSET_A : op == JIT_LDX ? OFFSET_X : OFFSET_Y;
+    emit_operand(e, mode, operand, pc, cycles);
+    store_field(e, EAX, reg);
+    EMIT(0x84, 0xC0); // test al, al
+    emit_flags(e, FLAGS_NZ);
+    return true;
+  }
+  case JIT_STA:
+  case JIT_STX:
+  case JIT_STY:
+    // the unofficial stores decode as implied, leave them to the interpreter
+    if (mode == ADDR_MODE_IMP) return false;
+    emit_store(e, mode, operand, pc, cycles,
+               op == JIT_STA ? OFFSET_A : op == JIT_STX ? OFFSET_X : OFFSET_Y);
+    return true;
+  case JIT_ADC:
+  case JIT_SBC:
+    emit_operand(e, mode, operand, pc, cycles);
+    EMIT(0x89, 0xC1);                        // mov ecx, eax
+    if (op == JIT_SBC) EMIT(0xF7, 0xD1);     // not ecx
+    load_field(e, EAX, OFFSET_A);
+    load_field(e, EDX, OFFSET_STATUS);
+    EMIT(0x0F, 0xBA, 0xE2, 0x00);            // bt edx, 0
+    EMIT(0x10, 0xC8);                        // adc al, cl
+    store_field(e, EAX, OFFSET_A);
+    emit_flags(e, FLAGS_NVZC);
+    return true;
+  case JIT_AND:
+  case JIT_ORA:
+  case JIT_EOR:
+    emit_operand(e, mode, operand, pc, cycles);
+    EMIT(0x89, 0xC1); // mov ecx, eax
+    load_field(e, EAX, OFFSET_A);
+    EMIT(op == JIT_AND ? 0x20 : op == JIT_ORA ? 0x08 : 0x30, 0xC8); // and/or/xor al, cl
+    store_field(e, EAX, OFFSET_A);
+    emit_flags(e, FLAGS_NZ);
+    return true;
+  case JIT_CMP:
+  case JIT_CPX:
+  case JIT_CPY:
+    emit_operand(e, mode, operand, pc, cycles);
+    EMIT(0x89, 0xC1); // mov ecx, eax
+    load_field(e, EAX, op == JIT_CMP ? OFFSET_A : op == JIT_CPX ? OFFSET_X : OFFSET_Y);
+    EMIT(0x38, 0xC8, 0xF5); // cmp al, cl; cmc
+    emit_flags(e, FLAGS_NZC);
+    return true;
+  case JIT_BIT:
+    emit_operand(e, mode, operand, pc, cycles);
+    EMIT(0x89, 0xC1);                         // mov ecx, eax
+    EMIT(0x81, 0xE1, 0xC0, 0x00, 0x00, 0x00); // and ecx, 0xC0
+    load_field(e, EDX, OFFSET_A);
+    EMIT(0x84, 0xC2);                         // test dl, al
+    EMIT(0x0F, 0x94, 0xC2, 0x0F, 0xB6, 0xD2); // setz dl; movzx edx, dl
+    EMIT(0xD1, 0xE2, 0x09, 0xD1);             // shl edx, 1; or ecx, edx
+    load_field(e, EDX, OFFSET_STATUS);
+    EMIT(0x81, 0xE2, 0x3D, 0x00, 0x00, 0x00); // and edx, 0x3D
+    EMIT(0x09, 0xCA);                         // or edx, ecx
+    store_field(e, EDX, OFFSET_STATUS);
+    return true;
+  case JIT_ASL:
+  case JIT_LSR:
+  case JIT_ROL:
+  case JIT_ROR:
+  case JIT_INC:
+  case JIT_DEC:
+    emit_modify(e, mode, operand, pc, cycles, op);
+    return true;
+  case JIT_INX: emit_step(e, OFFSET_X, true); return true;
+  case JIT_INY: emit_step(e, OFFSET_Y, true); return true;
+  case JIT_DEX: emit_step(e, OFFSET_X, false); return true;
+  case JIT_DEY: emit_step(e, OFFSET_Y, false); return true;
+  case JIT_TAX: emit_transfer(e, OFFSET_A, OFFSET_X, true); return true;
+  case JIT_TAY: emit_transfer(e, OFFSET_A, OFFSET_Y, true); return true;
+  case JIT_TXA: emit_transfer(e, OFFSET_X, OFFSET_A, true); return true;
+  case JIT_TYA: emit_transfer(e, OFFSET_Y, OFFSET_A, true); return true;
+  case JIT_TSX: emit_transfer(e, OFFSET_SP, OFFSET_X, true); return true;
+  case JIT_TXS: emit_transfer(e, OFFSET_X, OFFSET_SP, false); return true;
+  case JIT_CLC: emit_status(e, false, FLAG_CARRY); return true;
+  case JIT_SEC: emit_status(e, true, FLAG_CARRY); return true;
+  case JIT_SEI: emit_status(e, true, FLAG_INTERRUPT_DISABLE); return true;
+  case JIT_CLV: emit_status(e, false, FLAG_OVERFLOW); return true;
+  case JIT_CLD: emit_status(e, false, FLAG_DECIMAL_MODE); return true;
+  case JIT_SED: emit_status(e, true, FLAG_DECIMAL_MODE); return true;
+  case JIT_NOP: return true;
+  case JIT_PHA:
+  case JIT_PHP:
+    load_field(e, EAX, op == JIT_PHA ? OFFSET_A : OFFSET_STATUS);
+    if (op == JIT_PHP) EMIT(0x0C, FLAG_BREAK | FLAG_UNUSED); // or al, B | U
+    emit_push(e, 0);
+    EMIT(0xFE, 0x8B); // dec byte [rbx + sp]
+    emit32(e, OFFSET_SP);
+    return true;
+  case JIT_PLA:
+    emit_pop(e, 1);
+    store_field(e, ECX, OFFSET_SP);
+    store_field(e, EAX, OFFSET_A);
+    EMIT(0x84, 0xC0); // test al, al
+    emit_flags(e, FLAGS_NZ);
+    return true;
+  default:
+    // CLI and PLP may unmask a pending irq, the interpreter stops for it
+
+    return false;
+  }
+}
+
+static bool is_branch(JitOperation op) {
+  return op == JIT_BPL || op == JIT_BMI || op == JIT_BVC || op == JIT_BVS || op == JIT_BCC ||
+         op == JIT_BCS || op == JIT_BNE || op == JIT_BEQ;
+}
+
+/**
+ * Leaves the block for target, or goes around again when it jumps back to
+ * its own start and the budget allows for another full pass.
+ */
+static void emit_jump(Emitter *e, uint8_t *loop, uint16_t start, uint16_t target,
+                      uint32_t cycles, uint32_t max_cycles) {
+  if (target != start) {
+    emit_exit_jump(e, JMP, target, cycles);
+    return;
+  }
+
+  EMIT(0x41, 0x81, 0xC4); // add r12d, cycles
+  emit32(e, cycles);
+  EMIT(0x49, 0x8D, 0x84, 0x24); // lea rax, [r12 + max_cycles]
+  emit32(e, max_cycles);
+  EMIT(0x4C, 0x39, 0xF8); // cmp rax, r15
+  emit_exit_jump(e, JA, start, 0);
+  EMIT(0xE9); // jmp loop
+  emit32(e, loop - (e->code + 4));
+}
+
+/**
+ * Compiles a block starting at pc, at most length instructions long.
+ * Blocks may only leave their starting page when cross_pages is set.
+ */
+static JitCode jit_compile(CPU *cpu, uint16_t start, int length, bool cross_pages,
+                           uint16_t *max_cycles) {
+  Jit *jit = cpu->jit;
+  Bus *bus = cpu->bus;
+
+  Emitter emitter = {.code = jit->buffer + jit->buffer_used,
+                     .end = jit->buffer + JIT_BUFFER_SIZE};
+  Emitter *e = &emitter;
+  uint8_t *entry = e->code;
+
+  EMIT(0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, r12-r15
+  EMIT(0x48, 0x89, 0xFB);                                     // mov rbx, rdi
+  EMIT(0x49, 0x89, 0xF7);                                     // mov r15, rsi
+  EMIT(0x45, 0x31, 0xE4);                                     // xor r12d, r12d
+  EMIT(0x4C, 0x8B, 0xAB);                                     // mov r13, [rbx + bus]
+  emit32(e, offsetof(CPU, bus));
+  EMIT(0x4D, 0x8D, 0xB5); // lea r14, [r13 + write_pages]
+  emit32(e, offsetof(Bus, write_pages));
+  EMIT(0x4D, 0x8D, 0xAD); // lea r13, [r13 + read_pages]
+  emit32(e, offsetof(Bus, read_pages));
+
+  uint8_t *loop = e->code;
+  uint16_t pc = start;
+  uint32_t cycles = 0;
+  // every read that can cross a page may cost one more cycle in the worst case
+  uint32_t crossings = 0;
+  uint32_t most = 0;
+  int count = 0;
+  bool ended = false;
+
+  while (count < length && !ended) {
+    uint8_t *page = bus->read_pages[pc >> 8];
+    if (page == NULL) break;
+
+    uint8_t opcode = page[pc & 0xFF];
+    AddressingMode mode = instructions[opcode].addressing_mode;
+    JitOperation op = operations[opcode];
+    int size = 1 + operand_length[mode];
+
+    // instructions straddling two pages are left to the interpreter
+    if ((pc & 0xFF) + size > 0x100) break;
+    if (!cross_pages && pc != start && (pc >> 8) != (start >> 8)) break;
+
+    uint16_t operand = 0;
+    if (size > 1) operand = page[(pc + 1) & 0xFF];
+    if (size > 2) operand |= page[(pc + 2) & 0xFF] << 8;
+
+    uint16_t next = pc + size;
+    uint32_t base = instructions[opcode].cycles;
+
+    if (is_branch(op)) {
+      // BPL BMI BVC BVS BCC BCS BNE BEQ test N V C Z, set or clear
+      static const uint8_t flags[] = {FLAG_NEGATIVE, FLAG_OVERFLOW, FLAG_CARRY, FLAG_ZERO};
+      uint16_t target = next + (int8_t)operand;
+      uint32_t taken = cycles + base + 1 + ((target & 0xFF00) != (next & 0xFF00));
+      most = taken + crossings > most ? taken + crossings : most;
+
+      EMIT(0xF6, 0x83); // test byte [rbx + status], flag
+      emit32(e, OFFSET_STATUS);
+      emit8(e, flags[opcode >> 6]);
+
+      uint8_t *skip = e->code + 2;
+      EMIT((opcode & 0x20) ? 0x74 : 0x75, 0x00); // jz/jnz not taken
+      emit_jump(e, loop, start, target, taken, most);
+      if (!e->overflow) skip[-1] = e->code - skip;
+
+      emit_exit_jump(e, JMP, next, cycles + base);
+      ended = true;
+    } else if (op == JIT_JMP && mode == ADDR_MODE_ABS) {
+      cycles += base;
+      most = cycles + crossings > most ? cycles + crossings : most;
+      emit_jump(e, loop, start, operand, cycles, most);
+      ended = true;
+    } else if (op == JIT_JSR) {
+      uint16_t ret = next - 1;
+      EMIT(0xB8); // mov eax, ret >> 8
+      emit32(e, ret >> 8);
+      emit_push(e, 0);
+      EMIT(0xB8); // mov eax, ret & 0xFF
+      emit32(e, ret & 0xFF);
+      emit_push(e, 1);
+      EMIT(0x80, 0xAB); // sub byte [rbx + sp], 2
+      emit32(e, OFFSET_SP);
+      emit8(e, 2);
+      cycles += base;
+      most = cycles + crossings > most ? cycles + crossings : most;
+      emit_exit_jump(e, JMP, operand, cycles);
+      ended = true;
+    } else if (op == JIT_RTS) {
+      emit_pop(e, 2);
+      EMIT(0x89, 0xC7); // mov edi, eax
+      emit_pop(e, 1);
+      EMIT(0x80, 0x83); // add byte [rbx + sp], 2
+      emit32(e, OFFSET_SP);
+      emit8(e, 2);
+      EMIT(0xC1, 0xE7, 0x08, 0x09, 0xF8); // shl edi, 8; or eax, edi
+      EMIT(0xFF, 0xC0);                   // inc eax
+      EMIT(0x66, 0x89, 0x83);             // mov [rbx + pc], ax
+      emit32(e, OFFSET_PC);
+      cycles += base;
+      EMIT(0xB8); // mov eax, cycles
+      emit32(e, cycles);
+      most = cycles + crossings > most ? cycles + crossings : most;
+      emit_exit_jump(e, JMP, 0, cycles);
+      e->exits[e->exit_count - 1].dynamic_pc = true;
+      ended = true;
+    } else {
+      if (!compile_instruction(e, opcode, operand, pc, cycles)) break;
+
+      bool crossing = op == JIT_ADC || op == JIT_SBC || op == JIT_AND || op == JIT_ORA ||
+                      op == JIT_EOR || op == JIT_CMP || op == JIT_LDA || op == JIT_LDX ||
+                      op == JIT_LDY;
+      crossing &= mode == ADDR_MODE_ABX || mode == ADDR_MODE_ABY || mode == ADDR_MODE_IZY;
+
+      cycles += base;
+      crossings += crossing;
+      most = cycles + crossings > most ? cycles + crossings : most;
+    }
+
+    pc = next;
+    count++;
+  }
+
+  if (count == 0) return NULL;
+
+  if (!ended) {
+    emit_exit_jump(e, JMP, pc, cycles);
+  }
+
+  uint8_t *epilogue = e->code;
+  EMIT(0x44, 0x01, 0xE0);                                     // add eax, r12d
+  EMIT(0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B); // pop r15-r12, rbx
+  EMIT(0xC3);                                                 // ret
+
+  // exit stubs store the pc and the static cycles taken, then return
+  for (int i = 0; i < e->exit_count && !e->overflow; i++) {
+    JitExit *exit = &e->exits[i];
+
+    if (exit->dynamic_pc) {
+      patch32(exit->rel32, epilogue - (exit->rel32 + 4));
+      continue;
+    }
+
+    patch32(exit->rel32, e->code - (exit->rel32 + 4));
+    EMIT(0x66, 0xC7, 0x83); // mov word [rbx + pc], pc
+    emit32(e, OFFSET_PC);
+    emit8(e, exit->pc);
+    emit8(e, exit->pc >> 8);
+    EMIT(0xB8); // mov eax, cycles
+    emit32(e, exit->cycles);
+    EMIT(0xE9); // jmp epilogue
+    emit32(e, epilogue - (e->code + 4));
+  }
+
+  if (e->overflow) return NULL;
+
+  jit->buffer_used = e->code - jit->buffer;
+  *max_cycles = most;
+
+  return (JitCode)entry;
+}
+
+/** room always left for one more block, so compiling never runs out */
+#define JIT_BLOCK_ROOM (64 * 1024)
+
+static void jit_flush(Jit *jit) {
+  memset(jit->blocks, 0, sizeof(jit->blocks));
+  jit->buffer_used = 0;
+}
+
+static JitCode jit_build(CPU *cpu, uint16_t pc, int length, bool cross_pages,
+                         uint16_t *max_cycles) {
+  Jit *jit = cpu->jit;
+
+  mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE);
+  JitCode code = jit_compile(cpu, pc, length, cross_pages, max_cycles);
+  mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+  return code;
+}
+
+bool jit_enable(CPU *cpu) {
+  if (cpu->jit) return true;
+
+  Jit *jit = calloc(1, sizeof(Jit));
+  if (jit == NULL) return false;
+
+  jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+
+  if (jit->buffer == MAP_FAILED) {
+    free(jit);
+    return false;
+  }
+
+  cpu->jit = jit;
+  return true;
+}
+
+void jit_disable(CPU *cpu) {
+  if (cpu->jit == NULL) return;
+
+  munmap(cpu->jit->buffer, JIT_BUFFER_SIZE);
+  free(cpu->jit);
+  cpu->jit = NULL;
+}
+
+/**
+ * Looks up the block starting at pc, compiling it once it gets hot.
+ * Returns NULL while pc is not in rom or the block is not compiled.
+ */
+static JitBlock *jit_lookup(CPU *cpu, uint16_t pc) {
+  Jit *jit = cpu->jit;
+  Bus *bus = cpu->bus;
+
+  if (pc < 0x8000 || bus->write_pages[pc >> 8]) return NULL;
+
+  uint8_t *source = bus->read_pages[pc >> 8];
+  if (source == NULL) return NULL;
+
+  JitBlock *block = &jit->blocks[pc - 0x8000];
+
+  if (block->source != source || block->version != bus->rom_version) {
+    *block = (JitBlock){.source = source, .version = bus->rom_version};
+  }
+
+  if (block->code || block->failed) return block->code ? block : NULL;
+  if (++block->hits < JIT_THRESHOLD) return NULL;
+
+  if (jit->buffer_used > JIT_BUFFER_SIZE - JIT_BLOCK_ROOM) {
+    jit_flush(jit);
+    *block = (JitBlock){.source = source, .version = bus->rom_version};
+  }
+
+  block->code = jit_build(cpu, pc, JIT_BLOCK_LENGTH, false, &block->max_cycles);
+  block->failed = block->code == NULL;
+
+  return block->code ? block : NULL;
+}
+
+/**
+ * Runs up to the scheduler's next deadline like cpu_run, entering compiled
+ * blocks only when they are sure to finish before it, so events land on
+ * the same instruction boundaries as when interpreting.
+ */
+void jit_run(CPU *cpu) {
+  Scheduler *scheduler = cpu->bus->scheduler;
+
+  while (scheduler->clock < scheduler->next) {
+    uint16_t pc = cpu->pc;
+    uint64_t budget = scheduler->next - scheduler->clock;
+    JitBlock *block = jit_lookup(cpu, pc);
+    uint32_t cycles = 0;
+
+    if (block && block->max_cycles <= budget) {
+      cycles = block->code(cpu, budget < (1 << 30) ? budget : (1 << 30));
+    }
+
+    // a block may leave before its first instruction, on a dynamic i/o access
+    if (cycles == 0) cycles = cpu_step(cpu);
+
+    scheduler->clock += cycles;
+
+    // polling loops go through the interpreter, they may be idle
+    if (cpu->pc <= pc && scheduler->clock < scheduler->next) cpu_idle(cpu);
+  }
+}
+
+/**
+ * Runs a single instruction through the compiler wherever it is, falling
+ * back to the interpreter for what it does not handle. Used by the tests.
+ */
+uint8_t jit_step(CPU *cpu) {
+  uint16_t max_cycles;
+
+  jit_flush(cpu->jit);
+  JitCode code = jit_build(cpu, cpu->pc, 1, true, &max_cycles);
+
+  uint32_t cycles = code ? code(cpu, max_cycles) : 0;
+  if (cycles == 0) return cpu_step(cpu);
+
+  cpu->cycles = cycles;
+  return cycles;
+}
+
+#else
+
+bool jit_enable(CPU *cpu) { return false; }
+
+void jit_disable(CPU *cpu) {}
+
+void jit_run(CPU *cpu) {}
+
+uint8_t jit_step(CPU *cpu) { return cpu_step(cpu); }
+
+#endif
@@ -1,13 +1,24 @@
 #include "emulator.h"
 #include "frontend.h"
+#include "jit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// too large for the stack
+static Emulator emulator;
 
 int main(int argc, char **argv) {
   Frontend frontend;
-  Emulator emulator;
 
   frontend_init(&frontend);
   emulator_init(&emulator, argv[1]);
 
+  // happines <rom> --jit compiles hot rom code to native code
+  if (argc > 2 && strcmp(argv[2], "--jit") == 0 && !jit_enable(&emulator.cpu)) {
+    printf("jit is not supported on this platform, interpreting\n");
+  }
+
   frontend_run(&frontend, &emulator);
 
   return 0;
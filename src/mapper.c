@@ -1,5 +1,6 @@
 #include "mapper.h"
 #include <stdio.h>
+#include <string.h>
 
 uint8_t *mapper_test_read(Mapper *mapper, uint16_t addr) {
   return mapper->ram + addr;
@@ -40,6 +41,7 @@ bool mapper_000_chr_write(Mapper *mapper, uint16_t addr, uint8_t data) {
   if (addr >= 0x0000 && addr <= 0x1FFF) {
     if (mapper->chr_banks == 0) {
       mapper->chr_memory[addr] = data;
+      mapper->chr_dirty[addr >> 4] = true;
       return true;
     }
   }
@@ -92,6 +94,11 @@ bool mapper_001_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
     if (data & 0x80) { // reset
       mapper->load_register = 0;
       mapper->load_register_count = 0;
+
+      if ((mapper->control & 0x0C) != 0x0C) {
+        mapper->prg_version++;
+      }
+
       mapper->control |= 0x0C;
     } else {
       mapper->load_register >>= 1;
@@ -134,6 +141,15 @@ bool mapper_001_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
           }
         }
 
+        // the control register selects both bank sizes
+        if (reg != 3) {
+          mapper->chr_version++;
+        }
+
+        if (reg == 0 || reg == 3) {
+          mapper->prg_version++;
+        }
+
         mapper->load_register = 0;
         mapper->load_register_count = 0;
       }
@@ -166,6 +182,7 @@ uint8_t *mapper_001_chr_read(Mapper *mapper, uint16_t addr) {
 bool mapper_001_chr_write(Mapper *mapper, uint16_t addr, uint8_t data) {
   if (addr >= 0x0000 && addr <= 0x1FFF) {
     mapper->chr_memory[addr] = data;
+    mapper->chr_dirty[addr >> 4] = true;
     return true;
   }
 
@@ -193,8 +210,9 @@ uint8_t *mapper_002_prg_read(Mapper *mapper, uint16_t addr) {
 }
 
 bool mapper_002_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
-  if (addr >= 0x8000 && addr <= 0xFFFF) {
+  if (addr >= 0x8000 && addr <= 0xFFFF && mapper->prg_bank_lo != (data & 0x0F)) {
     mapper->prg_bank_lo = data & 0x0F;
+    mapper->prg_version++;
   }
 
   return false;
@@ -211,6 +229,7 @@ uint8_t *mapper_002_chr_read(Mapper *mapper, uint16_t addr) {
 bool mapper_002_chr_write(Mapper *mapper, uint16_t addr, uint8_t data) {
   if (addr >= 0x0000 && addr <= 0x1FFF) {
     mapper->chr_memory[addr] = data;
+    mapper->chr_dirty[addr >> 4] = true;
     return true;
   }
 
@@ -265,6 +284,11 @@ bool mapper_004_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
         mapper->chr_offsets[7] = mapper->registers[5] * 0x0400;
       }
 
+      mapper->chr_version++;
+
+      uint32_t prg_offsets[4];
+      memcpy(prg_offsets, mapper->prg_offsets, sizeof(prg_offsets));
+
       if (mapper->prg_bank_mode) {
         mapper->prg_offsets[2] = (mapper->registers[6] & 0x3F) * 0x2000;
         mapper->prg_offsets[0] = (mapper->prg_banks * 2 - 2) * 0x2000;
@@ -275,6 +299,10 @@ bool mapper_004_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
 
       mapper->prg_offsets[1] = (mapper->registers[7] & 0x3F) * 0x2000;
       mapper->prg_offsets[3] = (mapper->prg_banks * 2 - 1) * 0x2000;
+
+      if (memcmp(prg_offsets, mapper->prg_offsets, sizeof(prg_offsets)) != 0) {
+        mapper->prg_version++;
+      }
     } else {
       mapper->target_register = data & 0x07;
       mapper->prg_bank_mode = (data & 0x40) > 0;
@@ -286,7 +314,7 @@ bool mapper_004_prg_write(Mapper *mapper, uint16_t addr, uint8_t data) {
 
   if (addr >= 0xA000 && addr <= 0xBFFF) {
     if (addr & 0x01) {
-    } else {
+    } else if (mapper->mirror_mode != MIRRORING_FOUR_SCREEN) {
       if (data & 0x01) {
         mapper->mirror_mode = MIRRORING_HORIZONTAL;
       } else {
@@ -334,6 +362,7 @@ uint8_t *mapper_004_chr_read(Mapper *mapper, uint16_t addr) {
 bool mapper_004_chr_write(Mapper *mapper, uint16_t addr, uint8_t data) {
   if (addr >= 0x0000 && addr <= 0x1FFF) {
     mapper->chr_memory[addr] = data;
+    mapper->chr_dirty[addr >> 4] = true;
     return true;
   }
 
@@ -356,13 +385,15 @@ void mapper_004_scanline(Mapper *mapper) {
 
 // end of mappers
 
-void scanline() {}
-
 void mapper_init(Mapper *mapper, uint32_t mapper_id, uint8_t mirror_mode) {
   mapper->mirror_mode = mirror_mode;
-  mapper->scanline = scanline;
+  mapper->scanline = NULL;
   mapper->irq_active = false;
 
+  mapper->prg_version = 0;
+  mapper->chr_version = 0;
+  memset(mapper->chr_dirty, true, sizeof(mapper->chr_dirty));
+
   if (mapper_id == 0) {
     mapper->prg_read = mapper_000_prg_read;
     mapper->prg_write = mapper_000_prg_write;
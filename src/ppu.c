@@ -1,7 +1,91 @@
 #include "ppu.h"
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/** sprite line buffer entries are pixel | palette << 2 | these */
+#define SPRITE_BEHIND 0x10
+#define SPRITE_ZERO 0x20
+
+#define WORKER_LINES 64
+
+/**
+ * the cpu needs at least 12 dots between two register writes, so a line
+ * changes its scroll, mask or palette at most 22 times
+ */
+#define WORKER_SEGMENTS 32
+
+/** fine x, mask and palette a line is drawn with from dot x on */
+typedef struct {
+  int x;
+  uint8_t fine_x;
+  uint8_t mask;
+  uint8_t colors[32];
+} PPUSegment;
+
+/** sprite picked for a line, with its row of pixels fetched */
+typedef struct {
+  uint8_t x;
+  uint8_t flags;
+  uint8_t pixels[8];
+} PPULineSprite;
+
+/**
+ * What the worker draws a visible line from: the shifters as the line
+ * starts, holding its first two tiles, every tile loaded into them after
+ * that, the sprites picked for it and the state each run of dots is drawn
+ * with.
+ */
+typedef struct {
+  int scanline;
+  uint16_t pattern_lo;
+  uint16_t pattern_hi;
+  uint16_t attrib_lo;
+  uint16_t attrib_hi;
+
+  /** lsb, msb and attribute of each tile */
+  uint8_t tiles[31][3];
+  int tile_count;
+
+  PPULineSprite sprites[8];
+  int sprite_count;
+
+  PPUSegment segments[WORKER_SEGMENTS];
+  int segment_count;
+} PPULine;
+
+/**
+ * Lines travel to the worker through a single producer, single consumer
+ * ring. The emulation thread fills the line at head and publishes it after
+ * the last dot, the worker composes the one at tail. The mutex is only
+ * taken to wake a worker that found the ring empty.
+ */
+struct PPUWorker {
+  PPULine lines[WORKER_LINES];
+  uint32_t head;
+  uint32_t tail;
+
+  /** whether the line at head is being recorded */
+  bool recording;
+
+  /** sprites fetched for the line sprite_scanline, until it starts */
+  PPULineSprite sprites[8];
+  int sprite_count;
+  int sprite_scanline;
+
+  bool running;
+  bool sleeping;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+};
+
 const uint8_t mirror_lookup[][4] = {
     {0, 0, 1, 1}, // horizontal
     {0, 1, 0, 1}, // vertical
@@ -23,6 +107,36 @@ const uint32_t palette[] = {
     0xffc9c7ff, 0xffaacdff, 0xff96d6ef, 0xff95e0d0, 0xffa5e7b3, 0xffc3ea9f,
     0xffe6e89a, 0xffafafaf, 0xff000000, 0xff000000};
 
+/**
+ * palette in every output format, for each combination of the emphasis bits.
+ * emphasizing a color dims the other two
+ */
+static uint32_t colors_rgba[8][64];
+static uint16_t colors_rgb565[8][64];
+static uint8_t colors_gray[8][64];
+
+static void ppu_init_colors(void) {
+  for (int emphasis = 0; emphasis < 8; emphasis++) {
+    for (int i = 0; i < 64; i++) {
+      int channels[3];
+
+      for (int c = 0; c < 3; c++) {
+        channels[c] = (palette[i] >> (c * 8)) & 0xFF;
+
+        if (emphasis && !(emphasis & (1 << c))) {
+          channels[c] = channels[c] * 209 / 256;
+        }
+      }
+
+      int r = channels[0], g = channels[1], b = channels[2];
+
+      colors_rgba[emphasis][i] = 0xff000000 | b << 16 | g << 8 | r;
+      colors_rgb565[emphasis][i] = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+      colors_gray[emphasis][i] = (r * 77 + g * 150 + b * 29) >> 8;
+    }
+  }
+}
+
 uint8_t flip_byte(uint8_t byte) {
   byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
   byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
@@ -30,19 +144,91 @@ uint8_t flip_byte(uint8_t byte) {
   return byte;
 }
 
+/**
+ * Points the four nametables at the pages of vram the mirroring selects.
+ */
+static void ppu_map_nametables(PPU *ppu) {
+  ppu->mirror_mode = ppu->mapper->mirror(ppu->mapper);
+
+  for (int table = 0; table < 4; table++) {
+    ppu->nametables[table] = &ppu->raw_nametable[mirror_lookup[ppu->mirror_mode][table] * 0x0400];
+  }
+}
+
+/**
+ * Nametable and attribute fetches skip the mapper, which never maps them
+ */
+static inline uint8_t ppu_nametable_read(PPU *ppu, uint16_t addr) {
+  return ppu->nametables[(addr >> 10) & 0x03][addr & 0x03FF];
+}
+
+/**
+ * Which palette entry shows where a background and a sprite pixel meet, both
+ * as palette << 2 | pixel.
+ */
+static inline uint8_t ppu_priority(uint8_t background, uint8_t sprite) {
+  if (!(background & 0x03)) background = 0;
+  if (!(sprite & 0x03)) return background;
+
+  if (!background || !(sprite & SPRITE_BEHIND)) return 0x10 | (sprite & 0x0F);
+
+  return background;
+}
+
+/**
+ * Draws a row of sprite pixels into a line buffer, over what is there
+ */
+static inline void ppu_draw_sprite(uint8_t *line, int x, uint8_t flags, const uint8_t *pixels) {
+  for (int i = 0; i < 8 && x + i < 256; i++) {
+    if (pixels[i]) {
+      line[x + i] = pixels[i] | flags;
+    }
+  }
+}
+
+/**
+ * Starts a new run of dots on the line being recorded when the cpu changes
+ * fine x, the mask or the palette in the middle of it.
+ */
+static void ppu_worker_change(PPU *ppu) {
+  PPUWorker *worker = ppu->worker;
+  if (!worker || !worker->recording) return;
+
+  PPULine *line = &worker->lines[worker->head % WORKER_LINES];
+  PPUSegment *segment = &line->segments[line->segment_count - 1];
+
+  if (segment->x != ppu->cycle - 1 && line->segment_count < WORKER_SEGMENTS) {
+    segment = &line->segments[line->segment_count++];
+    segment->x = ppu->cycle - 1;
+  }
+
+  segment->fine_x = ppu->fine_x;
+  segment->mask = ppu->mask.reg;
+  memcpy(segment->colors, ppu->palette_colors, 32);
+}
+
+/**
+ * Recomputes the colors the palette draws with. Entries 0x10, 0x14, 0x18 and
+ * 0x1C share their bytes with 0x00, 0x04, 0x08 and 0x0C, and grayscale keeps
+ * only the brightness of each color.
+ */
+static void ppu_update_palette(PPU *ppu) {
+  uint8_t mask = ppu->mask.grayscale ? 0x30 : 0x3F;
+
+  for (int i = 0; i < 32; i++) {
+    ppu->palette_colors[i] = ppu->palette[(i & 0x13) == 0x10 ? i & 0x0F : i] & mask;
+  }
+
+  ppu_worker_change(ppu);
+}
+
 uint8_t ppu_read(PPU *ppu, uint16_t addr, bool readonly) {
   uint8_t *mapper_data = ppu->mapper->chr_read(ppu->mapper, addr);
 
   if (mapper_data) {
     return *mapper_data;
   } else if (addr >= 0x2000 && addr <= 0x3EFF) { // nametable
-    uint8_t mirror_mode = ppu->mapper->mirror(ppu->mapper);
-    int mirror_addr = (addr - 0x2000) % 0x1000;
-    uint8_t table = mirror_addr / 0x0400;
-    int offset = mirror_addr % 0x0400;
-    uint16_t index =
-        mirror_lookup[mirror_mode][table] * 0x0400 + offset + 0x2000;
-    return ppu->raw_nametable[index % 2048];
+    return ppu_nametable_read(ppu, addr);
   } else if (addr >= 0x3F00 && addr <= 0x3FFF) { // palette
     addr &= 0x001F;
 
@@ -64,13 +250,7 @@ uint8_t ppu_read(PPU *ppu, uint16_t addr, bool readonly) {
 void ppu_write(PPU *ppu, uint16_t addr, uint8_t data) {
   if (ppu->mapper->chr_write(ppu->mapper, addr, data)) {
   } else if (addr >= 0x2000 && addr <= 0x3EFF) { // nametable
-    uint8_t mirror_mode = ppu->mapper->mirror(ppu->mapper);
-    int mirror_addr = (addr - 0x2000) % 0x1000;
-    uint8_t table = mirror_addr / 0x0400;
-    int offset = mirror_addr % 0x0400;
-    uint16_t index =
-        mirror_lookup[mirror_mode][table] * 0x0400 + offset + 0x2000;
-    ppu->raw_nametable[index % 2048] = data;
+    ppu->nametables[(addr >> 10) & 0x03][addr & 0x03FF] = data;
   } else if (addr >= 0x3F00 && addr <= 0x3FFF) { // palette
     addr &= 0x001F;
 
@@ -84,12 +264,77 @@ void ppu_write(PPU *ppu, uint16_t addr, uint8_t data) {
       addr = 0x000C;
 
     ppu->palette[addr] = data;
+    ppu_update_palette(ppu);
+  }
+}
+
+static void ppu_decode_row(uint8_t lsb, uint8_t msb, uint8_t *pixels) {
+  for (int col = 0; col < 8; col++) {
+    pixels[col] = ((msb >> (7 - col)) & 0x01) << 1 | ((lsb >> (7 - col)) & 0x01);
+  }
+}
+
+/**
+ * Decodes both bitplanes of a chr tile to pixels, as stored and flipped
+ * horizontally for sprites.
+ */
+static void ppu_decode_tile(PPU *ppu, uint32_t tile) {
+  uint8_t *data = &ppu->mapper->chr_memory[tile * 16];
+
+  for (int row = 0; row < 8; row++) {
+    ppu_decode_row(data[row], data[row + 8], ppu->chr_tiles[0][tile][row]);
+    ppu_decode_row(flip_byte(data[row]), flip_byte(data[row + 8]), ppu->chr_tiles[1][tile][row]);
+  }
+
+  ppu->mapper->chr_dirty[tile] = false;
+}
+
+/**
+ * Points the pattern table banks at the chr the mapper has switched in.
+ */
+static void ppu_map_chr(PPU *ppu) {
+  Mapper *mapper = ppu->mapper;
+
+  for (int i = 0; i < 8; i++) {
+    ppu->chr_banks[i] = (mapper->chr_read(mapper, i * 0x0400) - mapper->chr_memory) / 16;
+  }
+
+  ppu->chr_version = mapper->chr_version;
+}
+
+/**
+ * Catches up with bank and mirroring switches the mapper made since the
+ * last time the ppu looked.
+ */
+static void ppu_sync_mapper(PPU *ppu) {
+  if (ppu->chr_version != ppu->mapper->chr_version) {
+    ppu_map_chr(ppu);
+  }
+
+  if (ppu->mirror_mode != ppu->mapper->mirror(ppu->mapper)) {
+    ppu_map_nametables(ppu);
   }
 }
 
-static inline uint32_t ppu_get_color(PPU *ppu, uint8_t palette_id,
-                                     uint8_t pixel) {
-  return palette[ppu_read(ppu, 0x3F00 + (palette_id << 2) + pixel, false)];
+static inline uint32_t ppu_tile(PPU *ppu, uint16_t addr) {
+  return ppu->chr_banks[addr >> 10] + ((addr & 0x03FF) >> 4);
+}
+
+/**
+ * Pattern table reads skip the mapper, going through the banks mapped last
+ */
+static inline uint8_t ppu_pattern_read(PPU *ppu, uint16_t addr) {
+  return ppu->mapper->chr_memory[ppu_tile(ppu, addr) * 16 + (addr & 0x0F)];
+}
+
+static inline uint8_t *ppu_tile_row(PPU *ppu, uint16_t addr, bool flip) {
+  uint32_t tile = ppu_tile(ppu, addr);
+
+  if (ppu->mapper->chr_dirty[tile]) {
+    ppu_decode_tile(ppu, tile);
+  }
+
+  return ppu->chr_tiles[flip][tile][addr & 0x07];
 }
 
 uint8_t ppu_control_read(PPU *ppu, uint16_t addr, bool readonly) {
@@ -97,6 +342,7 @@ uint8_t ppu_control_read(PPU *ppu, uint16_t addr, bool readonly) {
   switch (addr) {
   case 2:
     data = (ppu->status.reg & 0xE0) | (ppu->ppu_data_buffer & 0x1F);
+    ppu->status_read = ppu->status.reg & 0xE0;
     ppu->status.vertical_blank = 0;
     ppu->address_latch = 0;
     break;
@@ -129,9 +375,13 @@ void ppu_control_write(PPU *ppu, uint16_t addr, uint8_t data) {
     ppu->control.reg = data;
     ppu->tram_addr.nametable_x = ppu->control.nametable_x;
     ppu->tram_addr.nametable_y = ppu->control.nametable_y;
+    ppu_schedule(ppu);
     break;
   case 1:
     ppu->mask.reg = data;
+    ppu_update_palette(ppu);
+    // rendering toggles the mapper scanline counter
+    ppu_schedule(ppu);
     break;
   case 3: // OAM Address
     ppu->oam_addr = data;
@@ -145,6 +395,7 @@ void ppu_control_write(PPU *ppu, uint16_t addr, uint8_t data) {
       ppu->fine_x = data & 0x07;
       ppu->tram_addr.coarse_x = data >> 3;
       ppu->address_latch = 1;
+      ppu_worker_change(ppu);
     } else {
       ppu->tram_addr.fine_y = data & 0x07;
       ppu->tram_addr.coarse_y = data >> 3;
@@ -170,10 +421,27 @@ void ppu_control_write(PPU *ppu, uint16_t addr, uint8_t data) {
   }
 }
 
-void ppu_init(PPU *ppu, Mapper *mapper, uint8_t mirroring) {
+void ppu_init(PPU *ppu, Mapper *mapper, Scheduler *scheduler, uint8_t mirroring) {
+  ppu_init_colors();
+
   ppu->mapper = mapper;
+  ppu->scheduler = scheduler;
   ppu->cycle = 0;
   ppu->scanline = 0;
+
+  ppu->nmi = false;
+  ppu->frame_complete = false;
+  ppu->status_read = 0;
+
+  ppu->debug = NULL;
+  ppu->worker = NULL;
+  ppu->skip_render = false;
+  ppu_update_palette(ppu);
+
+  ppu->dot = 0;
+  ppu->chr_version = mapper->chr_version - 1;
+  ppu_map_nametables(ppu);
+  ppu_schedule(ppu);
 }
 
 void ppu_increment_scroll_x(PPU *ppu) {
@@ -231,6 +499,15 @@ void load_background_shifters(PPU *ppu) {
                               ((ppu->bg_next_tile_attrib & 0b01) ? 0xFF : 0x00);
   ppu->bg_shifter_attrib_hi = (ppu->bg_shifter_attrib_hi & 0xFF00) |
                               ((ppu->bg_next_tile_attrib & 0b10) ? 0xFF : 0x00);
+
+  if (ppu->worker && ppu->worker->recording) {
+    PPULine *line = &ppu->worker->lines[ppu->worker->head % WORKER_LINES];
+    uint8_t *tile = line->tiles[line->tile_count++];
+
+    tile[0] = ppu->bg_next_tile_lsb;
+    tile[1] = ppu->bg_next_tile_msb;
+    tile[2] = ppu->bg_next_tile_attrib;
+  }
 }
 
 void update_shifters(PPU *ppu) {
@@ -240,19 +517,331 @@ void update_shifters(PPU *ppu) {
     ppu->bg_shifter_attrib_lo <<= 1;
     ppu->bg_shifter_attrib_hi <<= 1;
   }
+}
 
-  if (ppu->mask.render_sprites && ppu->cycle >= 1 && ppu->cycle < 258) {
-    for (uint8_t i = 0; i < ppu->sprite_count; i++) {
-      if (ppu->sprite_scanline[i].x > 0) {
-        ppu->sprite_scanline[i].x--;
-      } else {
-        ppu->sprite_shifter_pattern_lo[i] <<= 1;
-        ppu->sprite_shifter_pattern_hi[i] <<= 1;
-      }
+/**
+ * Bit i is set when oam entry i is on the current line
+ */
+static inline uint64_t ppu_sprites_on_line(PPU *ppu, int height) {
+#ifdef __SSE2__
+  const __m128i *oam = (const __m128i *)ppu->oam;
+  __m128i low = _mm_set1_epi32(0xFF);
+  __m128i line = _mm_set1_epi8((char)ppu->scanline);
+  __m128i last_row = _mm_set1_epi8((char)(height - 1));
+  uint64_t hits = 0;
+
+  for (int i = 0; i < 4; i++) {
+    // y is the first byte of each entry, packed down to 16 entries a vector
+    __m128i y01 = _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(&oam[i * 4 + 0]), low),
+                                  _mm_and_si128(_mm_loadu_si128(&oam[i * 4 + 1]), low));
+    __m128i y23 = _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(&oam[i * 4 + 2]), low),
+                                  _mm_and_si128(_mm_loadu_si128(&oam[i * 4 + 3]), low));
+    __m128i y = _mm_packus_epi16(y01, y23);
+
+    // y <= line and line - y <= height - 1, unsigned
+    __m128i row = _mm_sub_epi8(line, y);
+    __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(y, line), line);
+    __m128i within = _mm_cmpeq_epi8(_mm_min_epu8(row, last_row), row);
+
+    hits |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_and_si128(above, within)) << (i * 16);
+  }
+
+  return hits;
+#else
+  uint64_t hits = 0;
+
+  for (int i = 0; i < 64; i++) {
+    int diff = ppu->scanline - ppu->oam[i].y;
+    if (diff >= 0 && diff < height) hits |= (uint64_t)1 << i;
+  }
+
+  return hits;
+#endif
+}
+
+/**
+ * Picks the first eight sprites on the line. Past the eighth the hardware
+ * keeps looking for another one to set the overflow flag, but steps through
+ * oam diagonally, reading tile ids, attributes and x positions as y.
+ */
+static void ppu_evaluate_sprites(PPU *ppu) {
+  int height = ppu->control.sprite_size ? 16 : 8;
+  uint64_t hits = ppu_sprites_on_line(ppu, height);
+
+  memset(ppu->sprite_scanline, 0xFF, sizeof(ppu->sprite_scanline));
+  ppu->sprite_count = 0;
+  ppu->sprite_zero = hits & 1;
+
+  int entry = 0;
+
+  while (hits && ppu->sprite_count < 8) {
+    entry = __builtin_ctzll(hits);
+    hits &= hits - 1;
+
+    ppu->sprite_scanline[ppu->sprite_count++] = ppu->oam[entry];
+  }
+
+  if (ppu->sprite_count < 8 || !(ppu->mask.render_background || ppu->mask.render_sprites)) {
+    return;
+  }
+
+  uint8_t *oam = (uint8_t *)ppu->oam;
+
+  for (int n = entry + 1, m = 0; n < 64; n++, m = (m + 1) & 0x03) {
+    int diff = ppu->scanline - oam[n * 4 + m];
+
+    if (diff >= 0 && diff < height) {
+      ppu->status.sprite_overflow = 1;
+      break;
+    }
+  }
+}
+
+/**
+ * Draws the sprites picked for the next line into the line buffer, from the
+ * last one to the first so the lowest oam index ends up in front
+ */
+static void ppu_fetch_sprites(PPU *ppu) {
+  PPUWorker *worker = ppu->skip_render ? NULL : ppu->worker;
+
+  memset(ppu->sprite_line, 0, sizeof(ppu->sprite_line));
+
+  if (worker) {
+    worker->sprite_count = 0;
+    worker->sprite_scanline = ppu->scanline + 1;
+  }
+
+  // the pre-render line never picks sprites for the first one
+  if (ppu->scanline < 0) return;
+
+  // skipped frames only need sprite zero, for its hit
+  int count = ppu->sprite_count;
+  if (ppu->skip_render) count = ppu->sprite_zero ? 1 : 0;
+
+  for (int i = count - 1; i >= 0; i--) {
+    Sprite *sprite = &ppu->sprite_scanline[i];
+    uint16_t sprite_pattern_addr_lo;
+
+    // only the low bits count, should the sprite size change after evaluation
+    int height = ppu->control.sprite_size ? 16 : 8;
+    int row = (ppu->scanline - sprite->y) & (height - 1);
+
+    if (sprite->attributes & 0x80) { // flipped
+      row = height - 1 - row;
     }
+
+    if (ppu->control.sprite_size) { // 16
+      sprite_pattern_addr_lo = ((sprite->tile_id & 0x01) << 12) |
+                               (((sprite->tile_id & 0xFE) + (row >> 3)) << 4) | (row & 0x07);
+    } else { // 8
+      sprite_pattern_addr_lo =
+          (ppu->control.pattern_sprite << 12) | (sprite->tile_id << 4) | row;
+    }
+
+    uint8_t *pixels = ppu_tile_row(ppu, sprite_pattern_addr_lo, sprite->attributes & 0x40);
+    uint8_t flags = ((sprite->attributes & 0x03) << 2) |
+                    ((sprite->attributes & 0x20) ? SPRITE_BEHIND : 0) |
+                    ((i == 0 && ppu->sprite_zero) ? SPRITE_ZERO : 0);
+
+    // the worker draws the sprites, the line buffer only needs sprite zero
+    if (worker) {
+      PPULineSprite *fetched = &worker->sprites[i];
+      fetched->x = sprite->x;
+      fetched->flags = flags;
+      memcpy(fetched->pixels, pixels, 8);
+
+      if (!(flags & SPRITE_ZERO)) continue;
+    }
+
+    ppu_draw_sprite(ppu->sprite_line, sprite->x, flags, pixels);
+  }
+
+  if (worker) worker->sprite_count = count;
+}
+
+static inline void ppu_sprite_zero_hit(PPU *ppu, uint8_t background, uint8_t sprite, int x) {
+  if ((sprite & SPRITE_ZERO) && (sprite & 0x03) && (background & 0x03) && x != 255) {
+    ppu->status.sprite_zero_hit = 1;
+  }
+}
+
+/**
+ * Puts a sprite pixel from the line buffer in front of or behind a
+ * background one, both as palette << 2 | pixel, and checks for a sprite zero
+ * hit, which never happens on the last column
+ */
+static inline uint8_t ppu_compose(PPU *ppu, uint8_t background, uint8_t sprite, int x) {
+  ppu_sprite_zero_hit(ppu, background, sprite, x);
+  return ppu_priority(background, sprite);
+}
+
+/**
+ * Starts recording the current line for the worker on its first dot, once
+ * the sprites for it were fetched with the worker running. The emulation
+ * thread waits here while the ring is full.
+ */
+static void ppu_worker_open(PPU *ppu) {
+  PPUWorker *worker = ppu->worker;
+  if (worker->sprite_scanline != ppu->scanline) return;
+
+  while (worker->head - __atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE) == WORKER_LINES) {
+    sched_yield();
+  }
+
+  PPULine *line = &worker->lines[worker->head % WORKER_LINES];
+  line->scanline = ppu->scanline;
+  line->pattern_lo = ppu->bg_shifter_pattern_lo;
+  line->pattern_hi = ppu->bg_shifter_pattern_hi;
+  line->attrib_lo = ppu->bg_shifter_attrib_lo;
+  line->attrib_hi = ppu->bg_shifter_attrib_hi;
+  line->tile_count = 0;
+
+  memcpy(line->sprites, worker->sprites, sizeof(line->sprites));
+  line->sprite_count = worker->sprite_count;
+
+  line->segments[0].x = 0;
+  line->segments[0].fine_x = ppu->fine_x;
+  line->segments[0].mask = ppu->mask.reg;
+  memcpy(line->segments[0].colors, ppu->palette_colors, 32);
+  line->segment_count = 1;
+
+  worker->recording = true;
+}
+
+/**
+ * Hands the current line to the worker, waking it if it ran out of lines.
+ */
+static void ppu_worker_publish(PPUWorker *worker) {
+  worker->recording = false;
+  __atomic_store_n(&worker->head, worker->head + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&worker->mutex);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->mutex);
   }
 }
 
+/**
+ * Draws the dots of a recorded line before end into the framebuffer, running
+ * the shifters over its tiles the way the ppu does dot by dot.
+ */
+static void ppu_worker_compose(PPU *ppu, PPULine *line, int end) {
+  uint8_t sprites[256] = {0};
+
+  for (int i = line->sprite_count - 1; i >= 0; i--) {
+    PPULineSprite *sprite = &line->sprites[i];
+    ppu_draw_sprite(sprites, sprite->x, sprite->flags, sprite->pixels);
+  }
+
+  uint16_t pattern_lo = line->pattern_lo, pattern_hi = line->pattern_hi;
+  uint16_t attrib_lo = line->attrib_lo, attrib_hi = line->attrib_hi;
+  uint8_t *out = &ppu->framebuffer[line->scanline * 256];
+  PPUSegment *segment = line->segments;
+  int next = 1, tile = 0;
+
+  for (int x = 0; x < end; x++) {
+    if (next < line->segment_count && line->segments[next].x == x) {
+      segment = &line->segments[next++];
+    }
+
+    bool render_background = segment->mask & 0x08;
+    bool render_sprites = segment->mask & 0x10;
+
+    // the shifters move from the 2nd dot on, and take a tile every 8th
+    if (x >= 1 && render_background) {
+      pattern_lo <<= 1;
+      pattern_hi <<= 1;
+      attrib_lo <<= 1;
+      attrib_hi <<= 1;
+    }
+
+    if (x >= 8 && !(x & 0x07) && tile < line->tile_count) {
+      uint8_t *next_tile = line->tiles[tile++];
+      pattern_lo = (pattern_lo & 0xFF00) | next_tile[0];
+      pattern_hi = (pattern_hi & 0xFF00) | next_tile[1];
+      attrib_lo = (attrib_lo & 0xFF00) | ((next_tile[2] & 0b01) ? 0xFF : 0x00);
+      attrib_hi = (attrib_hi & 0xFF00) | ((next_tile[2] & 0b10) ? 0xFF : 0x00);
+    }
+
+    uint8_t background = 0;
+
+    if (render_background) {
+      int bit = 15 - segment->fine_x;
+      background = ((attrib_hi >> bit) & 1) << 3 | ((attrib_lo >> bit) & 1) << 2 |
+                   ((pattern_hi >> bit) & 1) << 1 | ((pattern_lo >> bit) & 1);
+    }
+
+    uint8_t sprite = render_sprites ? sprites[x] : 0;
+    out[x] = segment->colors[ppu_priority(background, sprite)];
+  }
+
+  if (end) ppu->emphasis[line->scanline] = segment->mask >> 5;
+}
+
+/**
+ * Waits for the worker to compose every line handed to it so far.
+ */
+void ppu_worker_wait(PPU *ppu) {
+  PPUWorker *worker = ppu->worker;
+  if (!worker) return;
+
+  while (__atomic_load_n(&worker->tail, __ATOMIC_ACQUIRE) != worker->head) {
+    sched_yield();
+  }
+}
+
+/**
+ * Whether the line being drawn is recorded for the worker to compose
+ */
+static inline bool ppu_records_line(PPU *ppu) {
+  return ppu->worker && ppu->worker->recording;
+}
+
+/**
+ * Whether the pixels of the current line are needed here: always, unless the
+ * frame is skipped or the worker composes the line, when only a possible
+ * sprite zero hit needs them
+ */
+static inline bool ppu_composes_line(PPU *ppu) {
+  return (!ppu->skip_render && !ppu_records_line(ppu)) ||
+         (ppu->sprite_zero && ppu->mask.render_background && ppu->mask.render_sprites);
+}
+
+/**
+ * Draws the pixel of the current dot from the shifters and the sprite line
+ */
+static void ppu_draw_dot(PPU *ppu) {
+  uint8_t bg_pixel = 0x00;
+  uint8_t bg_palette = 0x00;
+
+  if (ppu->mask.render_background) {
+    uint16_t bit_mux = 0x8000 >> ppu->fine_x;
+
+    uint8_t p0_pixel = (ppu->bg_shifter_pattern_lo & bit_mux) > 0;
+    uint8_t p1_pixel = (ppu->bg_shifter_pattern_hi & bit_mux) > 0;
+    bg_pixel = (p1_pixel << 1) | p0_pixel;
+
+    uint8_t bg_pal0 = (ppu->bg_shifter_attrib_lo & bit_mux) > 0;
+    uint8_t bg_pal1 = (ppu->bg_shifter_attrib_hi & bit_mux) > 0;
+    bg_palette = (bg_pal1 << 1) | bg_pal0;
+  }
+
+  int x = ppu->cycle - 1;
+  uint8_t background = (bg_palette << 2) | bg_pixel;
+  uint8_t sprite = ppu->mask.render_sprites ? ppu->sprite_line[x] : 0;
+
+  if (ppu_records_line(ppu)) {
+    ppu_sprite_zero_hit(ppu, background, sprite, x);
+    return;
+  }
+
+  uint8_t color = ppu_compose(ppu, background, sprite, x);
+
+  ppu->framebuffer[ppu->scanline * 256 + x] = ppu->palette_colors[color];
+  ppu->emphasis[ppu->scanline] = ppu->mask.reg >> 5;
+}
+
 void ppu_step(PPU *ppu) {
   if (ppu->scanline >= -1 && ppu->scanline < 240) {
     if (ppu->scanline == 0 && ppu->cycle == 0) {
@@ -263,10 +852,11 @@ void ppu_step(PPU *ppu) {
       ppu->status.vertical_blank = 0;
       ppu->status.sprite_overflow = 0;
       ppu->status.sprite_zero_hit = 0;
+      ppu->sprite_zero = false;
 
-      for (int i = 0; i < 8; i++) {
-        ppu->sprite_shifter_pattern_lo[i] = 0;
-        ppu->sprite_shifter_pattern_hi[i] = 0;
+      // skipped frames draw straight into the framebuffer
+      if (ppu->worker && ppu->skip_render) {
+        ppu_worker_wait(ppu);
       }
     }
 
@@ -279,16 +869,14 @@ void ppu_step(PPU *ppu) {
       case 0:
         load_background_shifters(ppu);
         ppu->bg_next_tile_id =
-            ppu_read(ppu, 0x2000 | (ppu->vram_addr.reg & 0x0FFF), false);
+            ppu_nametable_read(ppu, 0x2000 | (ppu->vram_addr.reg & 0x0FFF));
         break;
       case 2:
         ppu->bg_next_tile_attrib =
-            ppu_read(ppu,
-                     0x23C0 | (ppu->vram_addr.nametable_y << 11) |
-                         (ppu->vram_addr.nametable_x << 10) |
-                         ((ppu->vram_addr.coarse_y >> 2) << 3) |
-                         (ppu->vram_addr.coarse_x >> 2),
-                     false);
+            ppu_nametable_read(ppu, 0x23C0 | (ppu->vram_addr.nametable_y << 11) |
+                                        (ppu->vram_addr.nametable_x << 10) |
+                                        ((ppu->vram_addr.coarse_y >> 2) << 3) |
+                                        (ppu->vram_addr.coarse_x >> 2));
         if (ppu->vram_addr.coarse_y & 0x02) {
           ppu->bg_next_tile_attrib >>= 4;
         }
@@ -301,19 +889,15 @@ void ppu_step(PPU *ppu) {
 
       case 4:
         ppu->bg_next_tile_lsb =
-            ppu_read(ppu,
-                     (ppu->control.pattern_background << 12) +
-                         ((uint16_t)ppu->bg_next_tile_id << 4) +
-                         (ppu->vram_addr.fine_y) + 0,
-                     false);
+            ppu_pattern_read(ppu, (ppu->control.pattern_background << 12) +
+                                      ((uint16_t)ppu->bg_next_tile_id << 4) +
+                                      (ppu->vram_addr.fine_y) + 0);
         break;
       case 6:
         ppu->bg_next_tile_msb =
-            ppu_read(ppu,
-                     (ppu->control.pattern_background << 12) +
-                         ((uint16_t)ppu->bg_next_tile_id << 4) +
-                         (ppu->vram_addr.fine_y) + 8,
-                     false);
+            ppu_pattern_read(ppu, (ppu->control.pattern_background << 12) +
+                                      ((uint16_t)ppu->bg_next_tile_id << 4) +
+                                      (ppu->vram_addr.fine_y) + 8);
 
         break;
       case 7:
@@ -336,212 +920,578 @@ void ppu_step(PPU *ppu) {
 
     if (ppu->cycle == 338 || ppu->cycle == 340) {
       ppu->bg_next_tile_id =
-          ppu_read(ppu, 0x2000 | (ppu->vram_addr.reg & 0x0FFF), false);
+          ppu_nametable_read(ppu, 0x2000 | (ppu->vram_addr.reg & 0x0FFF));
     }
 
     // foreground
     if (ppu->cycle == 257 && ppu->scanline >= 0) {
-      memset(ppu->sprite_scanline, 0xFF, sizeof(ppu->sprite_scanline));
-      ppu->sprite_count = 0;
-
-      uint8_t entry = 0;
-      // TODO: use for
-      while (entry < 64 && ppu->sprite_count < 9) {
-        int diff = ppu->scanline - ppu->oam[entry].y;
-
-        if (diff >= 0 && diff < (ppu->control.sprite_size ? 16 : 8)) {
-          if (ppu->sprite_count < 8) {
-            memcpy(&ppu->sprite_scanline[ppu->sprite_count], &ppu->oam[entry],
-                   sizeof(Sprite));
-            ppu->sprite_count++;
-          }
-        }
+      ppu_evaluate_sprites(ppu);
+    }
+  }
+
+  if (ppu->cycle == 340 && ppu->scanline < 239) {
+    ppu_fetch_sprites(ppu);
+  }
+
+  if (ppu->scanline == 240) {
+    // do nothing
+  }
+
+  if (ppu->scanline == 241 && ppu->cycle == 1) {
+    ppu->status.vertical_blank = 1;
+
+    if (ppu->control.enable_nmi) {
+      ppu->nmi = true;
+      scheduler_break(ppu->scheduler);
+    }
+  }
+
+  if (ppu->scanline >= 0 && ppu->scanline < 240 && ppu->cycle >= 1 && ppu->cycle <= 256) {
+    if (ppu->cycle == 1 && ppu->worker && !ppu->skip_render) {
+      ppu_worker_open(ppu);
+    }
+
+    if (ppu_composes_line(ppu)) {
+      ppu_draw_dot(ppu);
+    }
+
+    if (ppu->cycle == 256 && ppu_records_line(ppu)) {
+      ppu_worker_publish(ppu->worker);
+    }
+  }
 
-        entry++;
+  ppu->cycle++;
+
+  if (ppu->mask.render_background || ppu->mask.render_sprites) {
+    if (ppu->cycle == 260 && ppu->scanline < 240 && ppu->mapper->scanline) {
+      ppu->mapper->scanline(ppu->mapper);
+
+      if (ppu->mapper->irq_active) {
+        scheduler_break(ppu->scheduler);
       }
     }
-    ppu->status.sprite_overflow = ppu->sprite_count > 8;
   }
 
-  if (ppu->cycle == 340) {
-    for (uint8_t i = 0; i < ppu->sprite_count; i++) {
-      uint8_t sprite_pattern_bits_lo, sprite_pattern_bits_hi;
-      uint16_t sprite_pattern_addr_lo, sprite_pattern_addr_hi;
+  if (ppu->cycle >= 341) {
+    ppu->cycle = 0;
+    ppu->scanline++;
+
+    if (ppu->scanline == 261) {
+      ppu->scanline = -1;
+      ppu->frame_complete = true;
+      scheduler_break(ppu->scheduler);
+    }
+  }
+}
+
+/**
+ * Runs whole tiles of a visible line, from a dot 2 + 8 * n up to dot 249,
+ * leaving exactly the state stepping dot by dot would. The bus catches the
+ * ppu up before every register write and bank switch, so a line is only split
+ * where the cpu changed something and the dots around it go through ppu_step.
+ */
+static void ppu_render_tiles(PPU *ppu, int tiles) {
+  uint8_t *colors = ppu->palette_colors;
+  uint8_t *line = &ppu->framebuffer[ppu->scanline * 256];
+
+  // a line the worker composes only needs its pixels for a sprite zero hit
+  bool record = ppu_records_line(ppu);
+  bool compose = ppu_composes_line(ppu);
+
+  if (!record) {
+    ppu->emphasis[ppu->scanline] = ppu->mask.reg >> 5;
+  }
 
-      Sprite *sprite = &ppu->sprite_scanline[i];
+  // palette << 2 | pixel of the two tiles in the shifters and of every tile fetched
+  uint8_t pixels[16 + 8 * 31];
 
-      if (ppu->control.sprite_size) {    // 16
-        if (sprite->attributes & 0x80) { // flipped
-          if (ppu->scanline - sprite->y < 8) {
-            sprite_pattern_addr_lo = ((sprite->tile_id & 0x01) << 12) |
-                                     ((sprite->tile_id & 0xFE) << 4) |
-                                     ((7 - (ppu->scanline - sprite->y)) & 0x07);
-          } else {
-            sprite_pattern_addr_lo = ((sprite->tile_id & 0x01) << 12) |
-                                     (((sprite->tile_id & 0xFE) + 1) << 4) |
-                                     ((7 - (ppu->scanline - sprite->y)) & 0x07);
-          }
-        } else {
-          if (ppu->scanline - sprite->y < 8) {
-            sprite_pattern_addr_lo = ((sprite->tile_id & 0x01) << 12) |
-                                     ((sprite->tile_id & 0xFE) << 4) |
-                                     ((ppu->scanline - sprite->y) & 0x07);
-          } else {
-            sprite_pattern_addr_lo = ((sprite->tile_id & 0x01) << 12) |
-                                     (((sprite->tile_id & 0xFE) + 1) << 4) |
-                                     ((ppu->scanline - sprite->y) & 0x07);
-          }
-        }
-      } else {                           // 8
-        if (sprite->attributes & 0x80) { // flipped
-          sprite_pattern_addr_lo = (ppu->control.pattern_sprite << 12) |
-                                   (sprite->tile_id << 4) |
-                                   (7 - (ppu->scanline - sprite->y));
+  for (int i = 0; compose && i < 16; i++) {
+    pixels[i] = ((ppu->bg_shifter_attrib_hi >> (15 - i)) & 1) << 3 |
+                ((ppu->bg_shifter_attrib_lo >> (15 - i)) & 1) << 2 |
+                ((ppu->bg_shifter_pattern_hi >> (15 - i)) & 1) << 1 |
+                ((ppu->bg_shifter_pattern_lo >> (15 - i)) & 1);
+  }
+
+  for (int tile = 0; tile < tiles; tile++) {
+    PPUAddress vram = ppu->vram_addr;
+
+    // fetched on the 2nd, 4th and 6th dot
+    uint8_t attrib =
+        ppu_nametable_read(ppu, 0x23C0 | (vram.nametable_y << 11) | (vram.nametable_x << 10) |
+                                    ((vram.coarse_y >> 2) << 3) | (vram.coarse_x >> 2));
+    if (vram.coarse_y & 0x02) attrib >>= 4;
+    if (vram.coarse_x & 0x02) attrib >>= 2;
+    ppu->bg_next_tile_attrib = attrib & 0x03;
+
+    uint16_t pattern = (ppu->control.pattern_background << 12) +
+                       ((uint16_t)ppu->bg_next_tile_id << 4) + vram.fine_y;
+    ppu->bg_next_tile_lsb = ppu_pattern_read(ppu, pattern + 0);
+    ppu->bg_next_tile_msb = ppu_pattern_read(ppu, pattern + 8);
+
+    if (compose) {
+      uint8_t *row = ppu_tile_row(ppu, pattern, false);
+      for (int i = 0; i < 8; i++) {
+        pixels[16 + tile * 8 + i] = ppu->bg_next_tile_attrib << 2 | row[i];
+      }
+
+      for (int i = 0; i < 8; i++) {
+        int x = ppu->cycle + i - 1;
+
+        // the shifters have moved i + 1 times by this dot
+        uint8_t background =
+            ppu->mask.render_background ? pixels[tile * 8 + ppu->fine_x + 1 + i] : 0;
+        uint8_t sprite = ppu->mask.render_sprites ? ppu->sprite_line[x] : 0;
+
+        if (record) {
+          ppu_sprite_zero_hit(ppu, background, sprite, x);
         } else {
-          sprite_pattern_addr_lo = (ppu->control.pattern_sprite << 12) |
-                                   (sprite->tile_id << 4) |
-                                   (ppu->scanline - sprite->y);
+          line[x] = colors[ppu_compose(ppu, background, sprite, x)];
         }
       }
+    }
+
+    if (ppu->mask.render_background) {
+      ppu->bg_shifter_pattern_lo <<= 8;
+      ppu->bg_shifter_pattern_hi <<= 8;
+      ppu->bg_shifter_attrib_lo <<= 8;
+      ppu->bg_shifter_attrib_hi <<= 8;
+    }
 
-      sprite_pattern_bits_lo = ppu_read(ppu, sprite_pattern_addr_lo, false);
-      sprite_pattern_addr_hi = sprite_pattern_addr_lo + 8;
-      sprite_pattern_bits_hi = ppu_read(ppu, sprite_pattern_addr_hi, false);
+    // the 7th dot moves to the next tile and the 8th loads it
+    ppu_increment_scroll_x(ppu);
+    load_background_shifters(ppu);
+    ppu->bg_next_tile_id = ppu_nametable_read(ppu, 0x2000 | (ppu->vram_addr.reg & 0x0FFF));
 
-      if (sprite->attributes & 0x40) {
-        sprite_pattern_bits_lo = flip_byte(sprite_pattern_bits_lo);
-        sprite_pattern_bits_hi = flip_byte(sprite_pattern_bits_hi);
+    ppu->cycle += 8;
+    ppu->dot += 8;
+  }
+}
+
+/**
+ * Moves over whole tiles of a line nobody is going to see, keeping only the
+ * scroll the cpu can read back
+ */
+static void ppu_skip_tiles(PPU *ppu, int tiles) {
+  for (int tile = 0; tile < tiles; tile++) {
+    ppu_increment_scroll_x(ppu);
+  }
+
+  ppu->cycle += tiles * 8;
+  ppu->dot += tiles * 8;
+}
+
+/**
+ * Dots from the current one that would only repeat what the previous dot
+ * did: the end of hblank and the vertical blank lines.
+ */
+static int ppu_idle_dots(PPU *ppu) {
+  int end = ppu->cycle;
+
+  if (ppu->scanline >= 240) {
+    if (ppu->cycle >= 1 && (ppu->scanline != 241 || ppu->cycle >= 2)) end = 340;
+  } else if (ppu->cycle >= 261 && ppu->cycle < 321) {
+    end = 321;
+
+    // the vertical scroll is reloaded on dots 280 to 304 of the pre-render line
+    if (ppu->scanline == -1) {
+      if (ppu->cycle <= 280) end = 280;
+      else if (ppu->cycle < 305) end = 305;
+    }
+  }
+
+  return end - ppu->cycle;
+}
+
+void ppu_run(PPU *ppu, uint64_t dot) {
+  ppu_sync_mapper(ppu);
+
+  while (ppu->dot < dot) {
+    uint64_t left = dot - ppu->dot;
+
+    if (ppu->scanline >= 0 && ppu->scanline < 240 && ppu->cycle >= 2 && ppu->cycle < 250 &&
+        ((ppu->cycle - 2) & 0x07) == 0 && left >= 8) {
+      uint64_t tiles = (250 - ppu->cycle) / 8;
+      if (tiles > left / 8) tiles = left / 8;
+
+      if (ppu_composes_line(ppu) || ppu_records_line(ppu)) {
+        ppu_render_tiles(ppu, tiles);
+      } else {
+        ppu_skip_tiles(ppu, tiles);
       }
 
-      ppu->sprite_shifter_pattern_lo[i] = sprite_pattern_bits_lo;
-      ppu->sprite_shifter_pattern_hi[i] = sprite_pattern_bits_hi;
+      continue;
     }
+
+    ppu_step(ppu);
+    ppu->dot++;
+
+    // nothing can have changed since the dot before
+    uint64_t idle = ppu_idle_dots(ppu);
+    if (idle > dot - ppu->dot) idle = dot - ppu->dot;
+
+    ppu->cycle += idle;
+    ppu->dot += idle;
   }
 
-  if (ppu->scanline == 240) {
-    // do nothing
+  ppu_schedule(ppu);
+}
+
+#define DOTS_PER_LINE 341
+#define DOTS_PER_FRAME (262 * DOTS_PER_LINE)
+
+/**
+ * position of (scanline, cycle) counting from the pre-render line.
+ */
+static inline int ppu_position(int scanline, int cycle) {
+  return (scanline + 1) * DOTS_PER_LINE + cycle;
+}
+
+/**
+ * number of steps from the current position until the step that processes
+ * the given position. dot (0, 0) is always skipped.
+ */
+static inline int ppu_steps_until(PPU *ppu, int target) {
+  const int skipped = ppu_position(0, 0);
+  int position = ppu_position(ppu->scanline, ppu->cycle);
+
+  if (position == skipped) {
+    position++;
   }
 
-  if (ppu->scanline == 241 && ppu->cycle == 1) {
-    ppu->status.vertical_blank = 1;
+  int distance = target - position;
+  if (distance < 0) {
+    distance += DOTS_PER_FRAME;
+  }
 
-    if (ppu->control.enable_nmi) {
-      ppu->nmi = true;
-    }
+  if ((position < skipped && position + distance > skipped) ||
+      (position > skipped && position + distance > skipped + DOTS_PER_FRAME)) {
+    distance--;
   }
 
-  uint8_t bg_pixel = 0x00;
-  uint8_t bg_palette = 0x00;
+  return distance;
+}
 
-  if (ppu->mask.render_background) {
-    uint16_t bit_mux = 0x8000 >> ppu->fine_x;
+uint64_t ppu_next_event(PPU *ppu) {
+  // frame completes on the last dot of scanline 260
+  int steps = ppu_steps_until(ppu, ppu_position(260, 340));
 
-    uint8_t p0_pixel = (ppu->bg_shifter_pattern_lo & bit_mux) > 0;
-    uint8_t p1_pixel = (ppu->bg_shifter_pattern_hi & bit_mux) > 0;
-    bg_pixel = (p1_pixel << 1) | p0_pixel;
+  if (ppu->control.enable_nmi) {
+    int nmi = ppu_steps_until(ppu, ppu_position(241, 1));
+    if (nmi < steps) steps = nmi;
+  }
 
-    uint8_t bg_pal0 = (ppu->bg_shifter_attrib_lo & bit_mux) > 0;
-    uint8_t bg_pal1 = (ppu->bg_shifter_attrib_hi & bit_mux) > 0;
-    bg_palette = (bg_pal1 << 1) | bg_pal0;
+  // mapper is clocked at dot 260 (processed on 259) of lines -1 to 239
+  if ((ppu->mask.render_background || ppu->mask.render_sprites) && ppu->mapper->scanline) {
+    int scanline = ppu->cycle > 259 ? ppu->scanline + 1 : ppu->scanline;
+    if (scanline >= 240) scanline = -1;
+
+    int irq = ppu_steps_until(ppu, ppu_position(scanline, 259));
+    if (irq < steps) steps = irq;
   }
 
-  uint8_t fg_pixel = 0x00;
-  uint8_t fg_palette = 0x00;
-  uint8_t fg_priority = 0x00;
+  // the step that processes the event has to run as well
+  return ppu->dot + steps + 1;
+}
 
-  if (ppu->mask.render_sprites) {
-    for (uint8_t i = 0; i < ppu->sprite_count; i++) {
-      Sprite *sprite = &ppu->sprite_scanline[i];
-      if (sprite->x == 0) {
-        uint8_t fg_pixel_lo = (ppu->sprite_shifter_pattern_lo[i] & 0x80) > 0;
-        uint8_t fg_pixel_hi = (ppu->sprite_shifter_pattern_hi[i] & 0x80) > 0;
-        fg_pixel = (fg_pixel_hi << 1) | fg_pixel_lo;
+/**
+ * first line from the current one whose sprite evaluation may set a status
+ * flag, by finding sprite zero or eight sprites so the overflow search runs.
+ * 240 when no line left in the frame can
+ */
+static int ppu_status_line(PPU *ppu) {
+  int height = ppu->control.sprite_size ? 16 : 8;
+  int first = ppu->scanline < 0 ? 0 : ppu->scanline;
+  int line = 240;
 
-        fg_palette = (sprite->attributes & 0x03) + 0x04;
-        fg_priority = (sprite->attributes & 0x20) == 0;
+  // sprites starting and ending on each line
+  int8_t changes[241] = {0};
 
-        if (fg_pixel != 0) {
-          if (i == 0) {
-            ppu->status.sprite_zero_hit = 1;
-          }
+  for (int i = 0; i < 64; i++) {
+    int top = ppu->oam[i].y < first ? first : ppu->oam[i].y;
+    int bottom = ppu->oam[i].y + height > 240 ? 240 : ppu->oam[i].y + height;
+    if (top >= bottom) continue;
 
-          break;
-        }
-      }
+    if (i == 0 && !ppu->status.sprite_zero_hit) line = top;
+
+    changes[top]++;
+    changes[bottom]--;
+  }
+
+  if (ppu->status.sprite_overflow) return line;
+
+  for (int scanline = first, count = 0; scanline < line; scanline++) {
+    count += changes[scanline];
+    if (count >= 8) return scanline;
+  }
+
+  return line;
+}
+
+/**
+ * last dot up to which reading the status register is sure to return what
+ * its last read did. while the visible lines are rendered sprite zero hit
+ * and overflow can only be set on lines that sprite zero or eight sprites
+ * are on
+ */
+uint64_t ppu_status_stable_until(PPU *ppu) {
+  if (ppu->status.vertical_blank) return ppu->dot;
+
+  // a flag was set or cleared since the loop last looked
+  if ((ppu->status.reg & 0xE0) != ppu->status_read) return ppu->dot;
+
+  int steps = ppu_steps_until(ppu, ppu_position(241, 1));
+
+  int clear = ppu_steps_until(ppu, ppu_position(-1, 1));
+  if (clear < steps) steps = clear;
+
+  if ((ppu->mask.render_background || ppu->mask.render_sprites) && ppu->scanline < 240) {
+    // sprite zero is on the line being drawn
+    if (ppu->sprite_zero && !ppu->status.sprite_zero_hit) return ppu->dot;
+
+    int line = ppu_status_line(ppu);
+    if (line <= ppu->scanline) return ppu->dot;
+
+    // up to the end of the line before it
+    if (line < 240) {
+      int change = ppu_steps_until(ppu, ppu_position(line - 1, 340));
+      if (change < steps) steps = change;
     }
   }
 
-  uint8_t pixel = 0x00;
-  uint8_t palette = 0x00;
+  return ppu->dot + steps;
+}
 
-  if (bg_pixel == 0 && fg_pixel == 0) {
-    pixel = 0;
-    palette = 0;
-  } else if (bg_pixel == 0 && fg_pixel > 0) {
-    pixel = fg_pixel;
-    palette = fg_palette;
-  } else if (bg_pixel > 0 && fg_pixel == 0) {
-    pixel = bg_pixel;
-    palette = bg_palette;
-  } else {
-    if (fg_priority) {
-      pixel = fg_pixel;
-      palette = fg_palette;
-    } else {
-      pixel = bg_pixel;
-      palette = bg_palette;
+/**
+ * the cpu runs three dots per cycle, so the event is due on the first
+ * cycle that ends at or after it
+ */
+void ppu_schedule(PPU *ppu) {
+  scheduler_schedule(ppu->scheduler, EVENT_PPU, (ppu_next_event(ppu) + 2) / 3);
+}
+
+/**
+ * Starts keeping the pattern tables and nametables for the debug panel.
+ * Returns false if there is no memory for them.
+ */
+bool ppu_debug_open(PPU *ppu) {
+  if (ppu->debug) return true;
+
+  PPUDebug *debug = malloc(sizeof(PPUDebug));
+  if (!debug) return false;
+
+  debug->drawn = false;
+  ppu->debug = debug;
+  return true;
+}
+
+void ppu_debug_close(PPU *ppu) {
+  free(ppu->debug);
+  ppu->debug = NULL;
+}
+
+static void ppu_debug_draw_tile(PPU *ppu, uint16_t slot, uint8_t *colors, uint32_t *out,
+                                int pitch) {
+  for (int row = 0; row < 8; row++) {
+    uint8_t *pixels = ppu_tile_row(ppu, slot * 16 + row, false);
+
+    for (int col = 0; col < 8; col++) {
+      out[row * pitch + col] = colors_rgba[0][colors[pixels[col]]];
     }
   }
+}
+
+/**
+ * Brings the debug views up to date, drawing the pattern tables with one of
+ * the eight palettes.
+ */
+void ppu_debug_update(PPU *ppu, uint8_t palette) {
+  PPUDebug *debug = ppu->debug;
 
-  // boundary check
-  if (ppu->scanline >= 0 && ppu->scanline < 240 && ppu->cycle < 256) {
-    int pixel_index = ppu->scanline * 256 + ppu->cycle - 1;
-    ppu->framebuffer[pixel_index] = ppu_get_color(ppu, palette, pixel);
+  ppu_sync_mapper(ppu);
+
+  // chr currently banked in behind each pattern table tile
+  for (int slot = 0; slot < 512; slot++) {
+    uint8_t *data = &ppu->mapper->chr_memory[ppu_tile(ppu, slot * 16) * 16];
+
+    debug->chr_changed[slot] = !debug->drawn || memcmp(debug->chr[slot], data, 16) != 0;
+    memcpy(debug->chr[slot], data, 16);
   }
 
-  ppu->cycle++;
+  uint8_t *colors = ppu->palette_colors;
 
-  if (ppu->mask.render_background || ppu->mask.render_sprites) {
-    if (ppu->cycle == 260 && ppu->scanline < 240) {
-      ppu->mapper->scanline(ppu->mapper);
-    }
+  bool patterns_changed = !debug->drawn || palette != debug->pattern_palette ||
+                          memcmp(&colors[palette * 4], &debug->palette[palette * 4], 4) != 0;
+  bool nametables_changed = !debug->drawn ||
+                            ppu->control.pattern_background != debug->pattern_background ||
+                            memcmp(colors, debug->palette, 16) != 0;
+
+  memcpy(debug->palette, colors, 32);
+  debug->pattern_palette = palette;
+  debug->pattern_background = ppu->control.pattern_background;
+  debug->drawn = true;
+
+  for (int slot = 0; slot < 512; slot++) {
+    if (!patterns_changed && !debug->chr_changed[slot]) continue;
+
+    int x = (slot & 0x0F) * 8;
+    int y = ((slot >> 4) & 0x0F) * 8;
+    ppu_debug_draw_tile(ppu, slot, &colors[palette * 4],
+                        &debug->pattern_tables[slot >> 8][y * 128 + x], 128);
   }
 
-  if (ppu->cycle >= 341) {
-    ppu->cycle = 0;
-    ppu->scanline++;
+  // the four nametables side by side, as the scroll registers see them
+  for (int table = 0; table < 4; table++) {
+    uint8_t *data = ppu->nametables[table];
 
-    if (ppu->scanline == 261) {
-      ppu->scanline = -1;
-      ppu->frame_complete = true;
+    for (int i = 0; i < 960; i++) {
+      int x = i & 0x1F;
+      int y = i >> 5;
+
+      uint8_t attrib = data[0x03C0 + (y >> 2) * 8 + (x >> 2)];
+      attrib = (attrib >> ((y & 0x02) << 1 | (x & 0x02))) & 0x03;
+
+      uint16_t slot = ppu->control.pattern_background << 8 | data[i];
+      uint16_t tile = attrib << 8 | data[i];
+
+      if (!nametables_changed && !debug->chr_changed[slot] && debug->tiles[table][i] == tile) {
+        continue;
+      }
+
+      debug->tiles[table][i] = tile;
+
+      int offset = ((table >> 1) * 240 + y * 8) * 512 + (table & 0x01) * 256 + x * 8;
+      ppu_debug_draw_tile(ppu, slot, &colors[attrib * 4], &debug->nametables[offset], 512);
     }
   }
 }
 
-uint32_t *ppu_get_pattern_table(PPU *ppu, uint8_t i, uint8_t palette) {
-  for (int y = 0; y < 16; y++) {
-    for (int x = 0; x < 16; x++) {
-      int offset = y * 256 + x * 16;
+/**
+ * Converts the rendered frame to colors, pitch being the length of a line of
+ * pixels in bytes. Runs that never show the picture can skip this altogether.
+ */
+void ppu_convert_frame(PPU *ppu, PixelFormat format, void *pixels, int pitch) {
+  ppu_worker_wait(ppu);
+
+  for (int y = 0; y < 240; y++) {
+    uint8_t *line = &ppu->framebuffer[y * 256];
+    uint8_t *out = (uint8_t *)pixels + y * pitch;
+    uint8_t emphasis = ppu->emphasis[y];
+
+    switch (format) {
+    case PIXEL_FORMAT_RGBA32:
+      for (int x = 0; x < 256; x++) {
+        ((uint32_t *)out)[x] = colors_rgba[emphasis][line[x]];
+      }
+      break;
+    case PIXEL_FORMAT_RGB565:
+      for (int x = 0; x < 256; x++) {
+        ((uint16_t *)out)[x] = colors_rgb565[emphasis][line[x]];
+      }
+      break;
+    case PIXEL_FORMAT_GRAY8:
+      for (int x = 0; x < 256; x++) {
+        out[x] = colors_gray[emphasis][line[x]];
+      }
+      break;
+    }
+  }
+}
 
-      for (int row = 0; row < 8; row++) {
-        // read from the pattern table
-        uint8_t tile_lsb = ppu_read(ppu, i * 0x1000 + offset + row, false);
-        uint8_t tile_msb = ppu_read(ppu, i * 0x1000 + offset + row + 8, false);
+static void *ppu_worker_run(void *data) {
+  PPU *ppu = data;
+  PPUWorker *worker = ppu->worker;
 
-        for (int col = 0; col < 8; col++) {
-          uint8_t pixel = ((tile_lsb & 0x01) << 1) | (tile_msb & 0x01);
-          // FIXME: no mutation
-          tile_lsb >>= 1;
-          tile_msb >>= 1;
+  while (true) {
+    uint32_t tail = worker->tail;
 
-          int pixel_x = x * 8 + (7 - col);
-          int pixel_y = y * 8 + row;
-          int index = pixel_y * 128 + pixel_x;
-          ppu->pattern_table[i][index] = ppu_get_color(ppu, palette, pixel);
-        }
+    if (__atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == tail) {
+      pthread_mutex_lock(&worker->mutex);
+      __atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+
+      while (__atomic_load_n(&worker->head, __ATOMIC_SEQ_CST) == tail && worker->running) {
+        pthread_cond_wait(&worker->wake, &worker->mutex);
       }
+
+      __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+      bool stop = !worker->running && __atomic_load_n(&worker->head, __ATOMIC_ACQUIRE) == tail;
+      pthread_mutex_unlock(&worker->mutex);
+
+      if (stop) break;
+      continue;
+    }
+
+    ppu_worker_compose(ppu, &worker->lines[tail % WORKER_LINES], 256);
+    __atomic_store_n(&worker->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+/**
+ * Moves pixel composition to a thread of its own. The ppu keeps fetching and
+ * checking for sprite zero hits, and records the tiles, sprites and register
+ * changes of each line for the worker, which runs the shifters and fills in
+ * the framebuffer a few lines behind. Frames come out the same as without
+ * it. Returns false if the thread can't be started.
+ */
+bool ppu_worker_start(PPU *ppu) {
+  if (ppu->worker) return true;
+
+  PPUWorker *worker = malloc(sizeof(PPUWorker));
+  if (!worker) return false;
+
+  worker->head = 0;
+  worker->tail = 0;
+  worker->recording = false;
+  worker->sprite_count = 0;
+  worker->sprite_scanline = -2;
+  worker->running = true;
+  worker->sleeping = false;
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->wake, NULL);
+
+  ppu->worker = worker;
+
+  if (pthread_create(&worker->thread, NULL, ppu_worker_run, ppu) != 0) {
+    ppu->worker = NULL;
+    pthread_mutex_destroy(&worker->mutex);
+    pthread_cond_destroy(&worker->wake);
+    free(worker);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Lets the worker finish the lines it was given and stops it. A line the ppu
+ * is still in the middle of is drawn the usual way from then on.
+ */
+void ppu_worker_stop(PPU *ppu) {
+  PPUWorker *worker = ppu->worker;
+  if (!worker) return;
+
+  pthread_mutex_lock(&worker->mutex);
+  worker->running = false;
+  pthread_cond_signal(&worker->wake);
+  pthread_mutex_unlock(&worker->mutex);
+
+  pthread_join(worker->thread, NULL);
+  pthread_mutex_destroy(&worker->mutex);
+  pthread_cond_destroy(&worker->wake);
+
+  if (worker->recording) {
+    ppu_worker_compose(ppu, &worker->lines[worker->head % WORKER_LINES], ppu->cycle - 1);
+  }
+
+  // the line buffer only holds sprite zero
+  if (worker->sprite_scanline == ppu->scanline) {
+    for (int i = worker->sprite_count - 1; i >= 0; i--) {
+      PPULineSprite *sprite = &worker->sprites[i];
+      ppu_draw_sprite(ppu->sprite_line, sprite->x, sprite->flags, sprite->pixels);
     }
   }
 
-  return ppu->pattern_table[i];
+  ppu->worker = NULL;
+  free(worker);
 }
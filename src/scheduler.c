@@ -0,0 +1,114 @@
+#include "scheduler.h"
+
+static inline void swap(Scheduler *scheduler, int a, int b) {
+  Event tmp = scheduler->heap[a];
+  scheduler->heap[a] = scheduler->heap[b];
+  scheduler->heap[b] = tmp;
+
+  scheduler->index[scheduler->heap[a].type] = a;
+  scheduler->index[scheduler->heap[b].type] = b;
+}
+
+static void sift_up(Scheduler *scheduler, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (scheduler->heap[parent].deadline <= scheduler->heap[i].deadline) break;
+
+    swap(scheduler, i, parent);
+    i = parent;
+  }
+}
+
+static void sift_down(Scheduler *scheduler, int i) {
+  while (1) {
+    int left = 2 * i + 1;
+    int right = left + 1;
+    int smallest = i;
+
+    if (left < scheduler->count &&
+        scheduler->heap[left].deadline < scheduler->heap[smallest].deadline) {
+      smallest = left;
+    }
+
+    if (right < scheduler->count &&
+        scheduler->heap[right].deadline < scheduler->heap[smallest].deadline) {
+      smallest = right;
+    }
+
+    if (smallest == i) break;
+
+    swap(scheduler, i, smallest);
+    i = smallest;
+  }
+}
+
+static void remove_at(Scheduler *scheduler, int i) {
+  scheduler->index[scheduler->heap[i].type] = -1;
+  scheduler->count--;
+
+  if (i == scheduler->count) return;
+
+  scheduler->heap[i] = scheduler->heap[scheduler->count];
+  scheduler->index[scheduler->heap[i].type] = i;
+
+  sift_up(scheduler, i);
+  sift_down(scheduler, scheduler->index[scheduler->heap[i].type]);
+}
+
+void scheduler_init(Scheduler *scheduler) {
+  scheduler->clock = 0;
+  scheduler->next = UINT64_MAX;
+  scheduler->count = 0;
+
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    scheduler->index[i] = -1;
+  }
+}
+
+/**
+ * Schedules an event, moving it if it is already pending.
+ */
+void scheduler_schedule(Scheduler *scheduler, EventType type, uint64_t deadline) {
+  int i = scheduler->index[type];
+
+  if (i < 0) {
+    i = scheduler->count++;
+    scheduler->heap[i].type = type;
+    scheduler->index[type] = i;
+  }
+
+  scheduler->heap[i].deadline = deadline;
+  sift_up(scheduler, i);
+  sift_down(scheduler, scheduler->index[type]);
+
+  if (deadline < scheduler->next) {
+    scheduler->next = deadline;
+  }
+}
+
+void scheduler_cancel(Scheduler *scheduler, EventType type) {
+  if (scheduler->index[type] >= 0) {
+    remove_at(scheduler, scheduler->index[type]);
+  }
+}
+
+/**
+ * Removes the first event that is due. Once nothing else is due, the
+ * deadline the cpu runs to is brought up to date and false is returned.
+ */
+bool scheduler_pop(Scheduler *scheduler, EventType *type) {
+  if (scheduler->count > 0 && scheduler->heap[0].deadline <= scheduler->clock) {
+    *type = scheduler->heap[0].type;
+    remove_at(scheduler, 0);
+    return true;
+  }
+
+  scheduler->next = scheduler->count > 0 ? scheduler->heap[0].deadline : UINT64_MAX;
+  return false;
+}
+
+/**
+ * Stops the cpu after the current instruction, used when an interrupt is
+ * raised while catching up in the middle of one.
+ */
+void scheduler_break(Scheduler *scheduler) { scheduler->next = scheduler->clock; }
@@ -8,11 +8,21 @@ local lib = ffi.load("lib/libhappines.so")
 local n_tests = tonumber(arg[2]) or 100
 local opcode
 
+-- JIT=1 runs every instruction through the compiler instead
+local use_jit = os.getenv("JIT") ~= nil
+
+-- ffi.cdef has no preprocessor, so constants are substituted by hand
+local defines = {}
+
 local function load_header(name)
   local file = io.open("include/" .. name .. ".h", "r")
   local data = ""
   for line in file:lines() do
-    if not line:match("^#") then
+    local define, value = line:match("^#define%s+([%w_]+)%s+(.+)$")
+    if define then
+      defines[define] = value
+    elseif not line:match("^#") then
+      line = line:gsub("[%a_][%w_]*", function(word) return defines[word] end)
       data = data .. line .. "\n"
     end
   end
@@ -29,10 +39,14 @@ local function load_cpu()
   local bus = ffi.new("Bus")
   local mapper = ffi.new("Mapper")
 
-  lib.mapper_init(mapper, 0xffffffff)
-  lib.bus_init(bus, mapper, nil)
+  lib.mapper_init(mapper, 0xffffffff, 0)
+  lib.bus_init(bus, mapper, nil, nil, nil, nil)
   lib.cpu_init(cpu, bus)
 
+  if use_jit then
+    assert(lib.jit_enable(cpu), "jit is not supported on this platform")
+  end
+
   return cpu
 end
 
@@ -61,7 +75,7 @@ local function run_test(test, cpu)
   cpu.y = test.initial.y
   cpu.sp = test.initial.s
 
-  local cycles = lib.cpu_step(cpu)
+  local cycles = use_jit and lib.jit_step(cpu) or lib.cpu_step(cpu)
 
   local function assert_register(name, target)
     local expected = tonumber(test.final[target])
@@ -154,10 +168,157 @@ local function run_tests(tests, cpu)
   print(string.format("Passing: %d/%d", n_tests - errors, n_tests))
 end
 
+-- a cpu with a scheduler that starts running program at $8000, the other
+-- objects are returned too so they outlive it
+local function load_machine(program)
+  local mapper = ffi.new("Mapper")
+  local scheduler = ffi.new("Scheduler")
+  local bus = ffi.new("Bus")
+  local cpu = ffi.new("CPU")
+
+  lib.mapper_init(mapper, 0xffffffff, 0)
+  for i, byte in ipairs(program) do
+    mapper.ram[0x8000 + i - 1] = byte
+  end
+  mapper.ram[0xFFFC] = 0x00
+  mapper.ram[0xFFFD] = 0x80
+
+  lib.scheduler_init(scheduler)
+  lib.bus_init(bus, mapper, nil, nil, scheduler, nil)
+
+  -- the test mapper has ram everywhere, the jit only compiles rom
+  for page = 0x80, 0xFF do
+    bus.write_pages[page] = nil
+  end
+
+  lib.cpu_init(cpu, bus)
+
+  return cpu, mapper, scheduler, bus
+end
+
+-- runs a loop in slices of budget cycles, recording where each slice ended
+local function run_block(program, budget, slices, compile)
+  local cpu, mapper, scheduler, bus = load_machine(program)
+  cpu.x = 1
+
+  if compile then
+    assert(lib.jit_enable(cpu), "jit is not supported on this platform")
+  end
+
+  local stops = {}
+  for i = 1, slices do
+    scheduler.next = scheduler.clock + budget
+    lib.cpu_run(cpu)
+    stops[i] = { tonumber(scheduler.clock), cpu.pc }
+  end
+
+  if compile then
+    lib.jit_disable(cpu)
+  end
+
+  return stops
+end
+
+-- compiled blocks must stop on the same instruction boundaries as the
+-- interpreter, also when several of their reads cross a page
+local function run_block_tests()
+  local programs = {
+    -- LDA $80FF,X / LDA $81FF,X / STA $0300 / LDA $82FF,X / JMP $8000
+    { 0xBD, 0xFF, 0x80, 0xBD, 0xFF, 0x81, 0x8D, 0x00, 0x03, 0xBD, 0xFF, 0x82, 0x4C, 0x00, 0x80 },
+    -- the same loop with a single crossing
+    { 0xBD, 0xFF, 0x80, 0xBD, 0x00, 0x81, 0x8D, 0x00, 0x03, 0xBD, 0x00, 0x82, 0x4C, 0x00, 0x80 },
+  }
+
+  local message = [[
+
+  TEST FAILED
+    test: block %d, budget %d, slice %d
+    expected: clock %d pc 0x%04x
+    actual: clock %d pc 0x%04x
+  ]]
+
+  for n, program in ipairs(programs) do
+    for budget = 1, 80 do
+      local expected = run_block(program, budget, 64, false)
+      local actual = run_block(program, budget, 64, true)
+
+      for i = 1, #expected do
+        local e, a = expected[i], actual[i]
+        assert(e[1] == a[1] and e[2] == a[2], message:format(n, budget, i, e[1], e[2], a[1], a[2]))
+      end
+    end
+  end
+
+  print("Blocks: passing")
+end
+
+-- the unofficial stores decode as implied and always write to $0000, never
+-- to the address the previous instruction left behind
+local function run_store_tests()
+  -- LDA #$5A / STA $0300 / LDA #$A5 / SHA (0x89)
+  local cpu, mapper, scheduler = load_machine({ 0xA9, 0x5A, 0x8D, 0x00, 0x03, 0xA9, 0xA5, 0x89 })
+
+  -- all four in one run, the 10 cycles they take
+  scheduler.next = scheduler.clock + 10
+  lib.cpu_run(cpu)
+
+  local message = [[
+
+  TEST FAILED
+    test: 0x89 after an absolute store
+    expected: $0000 = 0xa5, $0300 = 0x5a
+    actual: $0000 = 0x%02x, $0300 = 0x%02x
+  ]]
+
+  local zero, stored = mapper.ram[0x0000], mapper.ram[0x0300]
+  assert(zero == 0xA5 and stored == 0x5A, message:format(zero, stored))
+
+  print("Stores: passing")
+end
+
+-- taking an interrupt spends its 7 cycles on the master clock
+local function run_interrupt_tests()
+  local cpu, mapper, scheduler = load_machine({ 0xEA })
+  mapper.ram[0xFFFA], mapper.ram[0xFFFB] = 0x00, 0x90
+  mapper.ram[0xFFFE], mapper.ram[0xFFFF] = 0x00, 0xA0
+
+  local message = [[
+
+  TEST FAILED
+    test: %s
+    expected: clock %d pc 0x%04x
+    actual: clock %d pc 0x%04x
+  ]]
+
+  local function check(name, clock, pc)
+    local actual = tonumber(scheduler.clock)
+    assert(actual == clock and cpu.pc == pc, message:format(name, clock, pc, actual, cpu.pc))
+  end
+
+  local start = tonumber(scheduler.clock)
+
+  lib.cpu_nmi(cpu)
+  check("nmi", start + 7, 0x9000)
+
+  -- the nmi set I, so the irq waits until it is cleared
+  lib.cpu_irq(cpu)
+  check("masked irq", start + 7, 0x9000)
+
+  cpu.status = band(cpu.status, bxor(0xFF, 0x04))
+  lib.cpu_irq(cpu)
+  check("irq", start + 14, 0xA000)
+
+  print("Interrupts: passing")
+end
+
 local function main()
+  def_header("scheduler")
   def_header("mapper")
+  def_header("ppu")
+  def_header("apu")
   def_header("bus")
   def_header("cpu")
+  def_header("jit")
 
   local filename = arg[1]
   opcode = filename:match("([%x]+).json")
@@ -171,6 +332,12 @@ local function main()
   local tests = load_test()
   local cpu = load_cpu()
   run_tests(tests, cpu)
+  run_store_tests()
+  run_interrupt_tests()
+
+  if use_jit then
+    run_block_tests()
+  end
 end
 
 main()